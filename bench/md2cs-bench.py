@@ -0,0 +1,223 @@
+#!/usr/bin/env python3
+"""End-to-end scaling benchmark for md2cs.
+
+Generates local fixture repositories and matching story.md files, runs the
+whole md2cs pipeline against them offline, and reports wall time, peak RSS
+and the objects written to target/repository at every scale point.
+
+Every parameter takes a comma-separated list, and each combination is one
+scale point:
+
+    bench/md2cs-bench.py --md2cs build/src/md2cs --pages 10,100,500
+
+Fixtures are built with `git fast-import` under the work directory and
+reused by later runs with the same parameters. With --cold, the page cache
+is dropped before every run (this needs root), to measure reads from disk.
+"""
+
+import argparse
+import csv
+import itertools
+import os
+import random
+import shutil
+import subprocess
+import sys
+import time
+
+TAG_PREFIX = "v"
+
+
+def int_list(value):
+    return [int(v) for v in value.split(",") if v]
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(
+        description="Run md2cs against synthetic stories of growing size")
+    parser.add_argument("--md2cs", default=shutil.which("md2cs") or "md2cs",
+                        help="md2cs executable (default: md2cs on PATH)")
+    parser.add_argument("--workdir", default="bench-work",
+                        help="where fixtures and runs are kept")
+    parser.add_argument("--tags", type=int_list, default=[0],
+                        help="tags in the source repository "
+                             "(0: one per page)")
+    parser.add_argument("--files", type=int_list, default=[50],
+                        help="files in the source tree")
+    parser.add_argument("--churn", type=int_list, default=[5],
+                        help="files rewritten from one tag to the next")
+    parser.add_argument("--size", type=int_list, default=[4096],
+                        help="bytes per file")
+    parser.add_argument("--pages", type=int_list, default=[10, 50, 100],
+                        help="pages of the story")
+    parser.add_argument("--repeat", type=int, default=1,
+                        help="runs per scale point, the fastest is kept")
+    parser.add_argument("--seed", type=int, default=1,
+                        help="seed of the generated contents")
+    parser.add_argument("--cold", action="store_true",
+                        help="drop the page cache before every run")
+    parser.add_argument("--csv", help="also write the results to this file")
+    parser.add_argument("md2cs_args", nargs=argparse.REMAINDER,
+                        help="extra md2cs arguments, after --")
+    return parser.parse_args()
+
+
+def file_content(rng, size):
+    line = "".join(rng.choice("abcdefghijklmnopqrstuvwxyz ")
+                   for _ in range(79)) + "\n"
+    content = (line * (size // len(line) + 1))[:size]
+    # A distinct header keeps the blobs from being identical
+    return ("// %d\n" % rng.getrandbits(64) + content)[:max(size, 1)]
+
+
+def write_data(stream, data):
+    payload = data.encode()
+    stream.write(b"data %d\n" % len(payload))
+    stream.write(payload)
+    stream.write(b"\n")
+
+
+def generate_repository(path, tags, files, churn, size, seed):
+    """Source repository with one commit and one lightweight tag per step."""
+    subprocess.run(["git", "init", "-q", "--bare", path], check=True)
+    rng = random.Random(seed)
+    importer = subprocess.Popen(["git", "fast-import", "--quiet"],
+                                cwd=path, stdin=subprocess.PIPE)
+    stream = importer.stdin
+    mark = 0
+    paths = ["src/module%03d/file%05d.txt" % (i % 100, i)
+             for i in range(files)]
+
+    for tag in range(1, tags + 1):
+        changed = paths if tag == 1 else rng.sample(paths,
+                                                    min(churn, files))
+        commands = []
+        for name in changed:
+            mark += 1
+            stream.write(b"blob\nmark :%d\n" % mark)
+            write_data(stream, file_content(rng, size))
+            commands.append("M 100644 :%d %s\n" % (mark, name))
+
+        mark += 1
+        stream.write(b"commit refs/heads/main\nmark :%d\n" % mark)
+        stream.write(b"committer md2cs bench <bench@md2cs> %d +0000\n"
+                     % (1700000000 + tag))
+        write_data(stream, "Step %d\n" % tag)
+        stream.write("".join(commands).encode())
+        stream.write(b"\nreset refs/tags/%s%d\nfrom :%d\n\n"
+                     % (TAG_PREFIX.encode(), tag, mark))
+
+    stream.write(b"done\n")
+    stream.close()
+    if importer.wait() != 0:
+        sys.exit("git fast-import failed for %s" % path)
+
+
+def generate_story(path, pages, tags):
+    with open(path, "w") as story:
+        story.write("---\n"
+                    "repository: ./source.git\n"
+                    "origin: ./origin.git\n"
+                    "---\n\n"
+                    "# Benchmark story\n\n"
+                    "A generated story of %d pages.\n\n" % pages)
+        for page in range(1, pages + 1):
+            tag = (page - 1) % tags + 1
+            story.write("---\n"
+                        "tag: %s%d\n"
+                        "focus: src\n"
+                        "---\n\n"
+                        "### Page %d\n\n"
+                        "Page %d of the story, at tag %s%d.\n\n"
+                        % (TAG_PREFIX, tag, page, page, TAG_PREFIX, tag))
+
+
+def fixture(workdir, tags, files, churn, size, pages, seed):
+    name = "t%d-f%d-c%d-s%d-p%d" % (tags, files, churn, size, pages)
+    path = os.path.abspath(os.path.join(workdir, name))
+    source = os.path.join(path, "source.git")
+
+    if not os.path.exists(source):
+        os.makedirs(path, exist_ok=True)
+        generate_repository(source, tags, files, churn, size, seed)
+        subprocess.run(["git", "init", "-q", "--bare",
+                        os.path.join(path, "origin.git")], check=True)
+    generate_story(os.path.join(path, "story.md"), pages, tags)
+    return name, path
+
+
+def count_objects(repository):
+    output = subprocess.run(["git", "-C", repository, "count-objects", "-v"],
+                            check=True, capture_output=True,
+                            text=True).stdout
+    fields = dict(line.split(": ") for line in output.splitlines())
+    return int(fields["count"]) + int(fields["in-pack"])
+
+
+def drop_page_cache():
+    os.sync()
+    try:
+        with open("/proc/sys/vm/drop_caches", "w") as drop:
+            drop.write("3\n")
+    except OSError as error:
+        sys.exit("cannot drop the page cache (%s), --cold needs root" % error)
+
+
+def run_md2cs(md2cs, path, extra, cold):
+    if cold:
+        drop_page_cache()
+
+    start = time.monotonic()
+    with open(os.path.join(path, "md2cs.log"), "w") as log:
+        process = subprocess.Popen([md2cs] + extra, cwd=path,
+                                   stdout=log, stderr=subprocess.STDOUT)
+        _, status, usage = os.wait4(process.pid, 0)
+    wall = time.monotonic() - start
+
+    if os.waitstatus_to_exitcode(status) != 0:
+        sys.exit("md2cs failed in %s, see md2cs.log" % path)
+
+    # ru_maxrss is in kilobytes on Linux
+    return wall, usage.ru_maxrss / 1024.0
+
+
+def main():
+    args = parse_args()
+    extra = [a for a in args.md2cs_args if a != "--"]
+
+    if not subprocess.run(["git", "config", "user.email"],
+                          capture_output=True).stdout:
+        sys.exit("md2cs commits as the git user, set user.name and "
+                 "user.email first")
+
+    columns = ["fixture", "pages", "tags", "files", "churn", "size",
+               "wall_s", "peak_rss_mb", "objects"]
+    rows = []
+    print("%-28s %8s %8s %12s %9s" % ("fixture", "pages", "wall s",
+                                      "peak RSS MB", "objects"))
+
+    for tags, files, churn, size, pages in itertools.product(
+            args.tags, args.files, args.churn, args.size, args.pages):
+        tags = tags or pages
+        name, path = fixture(args.workdir, tags, files, churn, size,
+                             pages, args.seed)
+        runs = [run_md2cs(args.md2cs, path, extra, args.cold)
+                for _ in range(args.repeat)]
+        wall, rss = min(runs)
+        objects = count_objects(os.path.join(path, "target", "repository"))
+
+        rows.append([name, pages, tags, files, churn, size,
+                     "%.3f" % wall, "%.1f" % rss, objects])
+        print("%-28s %8d %8.3f %12.1f %9d" % (name, pages, wall, rss,
+                                              objects))
+        sys.stdout.flush()
+
+    if args.csv:
+        with open(args.csv, "w", newline="") as output:
+            writer = csv.writer(output)
+            writer.writerow(columns)
+            writer.writerows(rows)
+
+
+if __name__ == "__main__":
+    main()
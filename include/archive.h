@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <git2.h>
+#include "pipeline.h"
+
+namespace fs = std::filesystem;
+
+// The tar of one page on its way to a compressor, a chunk at a time.
+// The writer blocks while the compressor is capacity chunks behind.
+struct ArchiveStream {
+  BoundedQueue<std::string> chunks;
+  std::atomic<bool> aborted;
+  explicit ArchiveStream(size_t capacity) :
+    chunks(capacity),
+    aborted(false)
+    { }
+};
+
+struct ArchiveJob {
+  fs::path file;
+  std::shared_ptr<ArchiveStream> stream;
+};
+
+// Writes page-<n>.tar.gz, the tree of each committed page, into a
+// directory while the story is built. The writer reads the tree from the
+// object database into a tar, which is streamed to a pool of threads
+// that compress it, so an archive never has to fit in memory: each one
+// in progress or waiting holds a few chunks at most. Entries have no
+// leading directory, so a page with the same tree as an earlier one just
+// gets a hard link to the earlier archive.
+class ArchiveExporter {
+public:
+  ArchiveExporter(const fs::path& dir, size_t threads);
+  ~ArchiveExporter();
+  ArchiveExporter(const ArchiveExporter&) = delete;
+  ArchiveExporter& operator=(const ArchiveExporter&) = delete;
+
+  int add(::git_repository* repo, int page, const ::git_oid& commitId);
+  // Waits for the pending archives. False if one could not be written.
+  bool finish();
+
+private:
+  void compress();
+
+  fs::path dir;
+  BoundedQueue<ArchiveJob> jobs;
+  std::vector<std::thread> workers;
+  std::map<std::string, fs::path> archives;
+  std::vector<std::pair<fs::path, fs::path>> links;
+  std::atomic<bool> failed;
+  bool finished;
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <filesystem>
+#include <map>
+#include <set>
+#include <string>
+#include <git2.h>
+#include "statcache.h"
+#include "diffindex.h"
+
+namespace fs = std::filesystem;
+
+// Directories of the story project, declared with the assets: key of a
+// page, kept in the story repository under the same name. Files are
+// staged by the id of their content: a file the index already holds with
+// that id is neither copied nor staged, and a blob the repository already
+// has, from another page or another name, is not written again. The ids
+// are kept in a manifest next to the part cache, which outlives the story
+// repository, so a file whose metadata did not change since the last run
+// is not even read. As in StatCache, a file modified in the second it was
+// recorded is hashed again.
+class AssetSync {
+public:
+  AssetSync(const fs::path& storyDir, const fs::path& manifestFile);
+  // dir is relative to the story project and to the story repository
+  int sync(::git_repository* repo,
+           const std::string& dir,
+           ChangeList& changes);
+  // Keeps the entries of the files synchronized in this run
+  bool save() const;
+  size_t unchanged() const { return nUnchanged; }
+
+private:
+  struct Entry {
+    ::git_oid id;
+    FileStat stat;
+    bool racy;
+  };
+  int contentId(::git_repository* repo,
+                const fs::path& file,
+                const std::string& relPath,
+                ::git_oid& id);
+  void load();
+  fs::path storyDir;
+  fs::path manifestFile;
+  std::map<std::string, Entry> manifest;
+  std::set<std::string> synced;
+  size_t nUnchanged;
+};
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <ostream>
+
+namespace fs = std::filesystem;
+
+// Writes file through a temporary next to it, renamed over file once
+// write returned true and every byte reached the disk cache, so readers
+// and later runs see the old file or the new one, never half of it. The
+// temporary has a name of its own for each call, so several threads or
+// processes may write the same file at once. False when nothing replaced
+// file; the temporary is removed then.
+bool writeFileAtomically(const fs::path& file,
+                         const std::function<bool(std::ostream&)>& write);
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <git2.h>
+#include "helper.h"
+
+// Writes refName as a v2 git bundle onto out, which `git clone` and
+// `git fetch` read like a remote. With a basis revision, the bundle lists
+// it as a prerequisite and only carries the objects that are not already
+// reachable from it.
+int writeBundle(::git_repository* repo,
+                const char* refName,
+                const std::string& basis,
+                std::ostream& out,
+                Options& options);
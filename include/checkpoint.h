@@ -0,0 +1,32 @@
+#pragma once
+
+#include <filesystem>
+#include <map>
+#include <string>
+#include <utility>
+#include <git2.h>
+
+namespace fs = std::filesystem;
+
+// The commit each (repository, tag or branch) of the story resolves to
+typedef std::map<std::pair<std::string, std::string>, ::git_oid>
+ResolvedRefs;
+
+// State of a build after its last committed page, kept in target/ so a
+// failed build can continue from there with --resume. The story digest
+// tells whether story.md or a file it includes changed since, which
+// makes resuming unsafe.
+struct Checkpoint {
+  std::string storyDigest;
+  int page;
+  ::git_oid commit;
+  bool forcePush;
+  ResolvedRefs refs;
+  Checkpoint() : storyDigest(), page(0), commit(), forcePush(false),
+                 refs() { }
+
+  bool load(const fs::path& targetPath);
+  bool save(const fs::path& targetPath) const;
+};
+
+bool hasCheckpoint(const fs::path& targetPath);
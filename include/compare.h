@@ -0,0 +1,34 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "statcache.h"
+
+namespace fs = std::filesystem;
+
+class BatchPool;
+
+enum CompareResult { SAME_STAT, SAME_CONTENT, DIFFERENT };
+
+typedef std::pair<fs::path, fs::path> FilePair;
+
+// Compares the source and story copies of the files of one directory on
+// a BatchPool, so their stat, open and read calls overlap instead of
+// running one after the other. Only the reads happen here; copies and
+// index updates stay with the caller, in order.
+class CompareEngine {
+public:
+  explicit CompareEngine(size_t threads);
+  ~CompareEngine();
+  CompareEngine(const CompareEngine&) = delete;
+  CompareEngine& operator=(const CompareEngine&) = delete;
+
+  void compare(const StatCache& statCache,
+               const std::vector<FilePair>& files,
+               std::vector<CompareResult>& results);
+
+private:
+  std::unique_ptr<BatchPool> pool;
+};
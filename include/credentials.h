@@ -0,0 +1,73 @@
+#pragma once
+
+#include <filesystem>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include <git2.h>
+
+namespace fs = std::filesystem;
+
+// What was used to authenticate against a host. libgit2 takes ownership
+// of every git_credential it receives, so these inputs are what gets
+// cached, and a new credential is built from them on each request.
+// The source tells candidates apart: "ssh-agent", a key file, a prompt.
+struct CredentialSpec {
+  unsigned int type;
+  bool fromAgent;
+  bool interactive;
+  std::string source;
+  std::string userName;
+  std::string secret;
+  fs::path privateKey;
+  fs::path publicKey;
+  CredentialSpec() : type(0), fromAgent(false), interactive(false) { }
+};
+
+// State of one clone or push, carried in the callbacks payload. libgit2
+// calls back again when a credential is rejected, possibly allowing other
+// types than before, so every call skips the candidates already tried.
+struct CredentialRequest {
+  std::set<std::pair<unsigned int, std::string>> tried;
+  bool hasLast;
+  CredentialSpec last;
+  CredentialRequest() : tried(), hasLast(false) { }
+};
+
+// Answers libgit2 credential requests without prompting whenever
+// possible: ssh-agent, MD2CS_SSH_KEY, MD2CS_TOKEN, a git-credentials
+// file and unencrypted keys in ~/.ssh come before any prompt, and prompts
+// only happen on a terminal. The credential that worked for a host is
+// kept, so each host is authenticated once per run. Safe to use from
+// several threads; a prompt only holds back the other prompts.
+class CredentialProvider {
+public:
+  static CredentialProvider& instance();
+
+  int acquire(::git_credential** out,
+              const std::string& url,
+              const std::string& userName,
+              unsigned int allowedTypes,
+              CredentialRequest& request);
+  void confirm(const std::string& url,
+               const CredentialRequest& request);
+
+private:
+  CredentialProvider() : scanned(false) { }
+  void scanOnce();
+  std::vector<CredentialSpec> candidates(const std::string& host,
+                                         const std::string& userName,
+                                         unsigned int allowedTypes);
+  bool prompt(CredentialSpec& spec);
+
+  std::mutex mutex;
+  std::mutex promptMutex;
+  bool scanned;
+  std::list<std::pair<fs::path, fs::path>> sshKeys;
+  std::multimap<std::string, CredentialSpec> storedCredentials;
+  std::map<std::string, CredentialSpec> confirmed;
+};
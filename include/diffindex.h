@@ -0,0 +1,72 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+#include <git2.h>
+
+namespace fs = std::filesystem;
+
+class BatchPool;
+
+enum ChangeType { FILE_ADDED, FILE_MODIFIED, FILE_DELETED };
+
+// A file the writer added, modified or removed in the story repository,
+// by its path in the repository
+struct FileChange {
+  std::string path;
+  ChangeType type;
+  FileChange(const std::string& path, ChangeType type) :
+    path(path),
+    type(type)
+    { }
+};
+
+typedef std::vector<FileChange> ChangeList;
+
+// The files each page changes, with the lines it adds and removes, so a
+// viewer of the story does not diff the pages itself. The writer hands in
+// the changes it made for a page once the page is committed: the old
+// contents are read from the parent commit on the caller's thread, and
+// the files are diffed on a BatchPool.
+class DiffIndex {
+public:
+  explicit DiffIndex(size_t threads);
+  ~DiffIndex();
+  DiffIndex(const DiffIndex&) = delete;
+  DiffIndex& operator=(const DiffIndex&) = delete;
+
+  int add(::git_repository* repo,
+          int page,
+          const ::git_oid& commitId,
+          const ChangeList& changes);
+  // Takes the pages up to lastPage from the index of an earlier run. A
+  // damaged index is only read up to the page it breaks in; false then.
+  bool load(const fs::path& file, int lastPage);
+  bool write(const fs::path& file) const;
+
+  struct FileStats {
+    ChangeType type;
+    std::string path;
+    bool binary;
+    size_t additions;
+    size_t deletions;
+  };
+
+  struct Job {
+    std::string before;
+    fs::path after;
+    FileStats* stats;
+  };
+
+private:
+  struct Page {
+    int number;
+    std::string commit;
+    std::vector<FileStats> files;
+  };
+
+  std::vector<Page> pages;
+  std::unique_ptr<BatchPool> pool;
+};
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <iostream>
+#include <git2.h>
+#include "helper.h"
+
+// Writes the first-parent history of refName as a git fast-import stream
+// onto out. Each distinct blob is sent once and referred to by its mark
+// afterwards; the commits keep the messages, signatures and trees of the
+// generated repository, so importing the stream gives the same commit ids.
+// It is an export of the finished story, read back from the repository
+// after the build: the pages are still committed through libgit2.
+int writeFastImport(::git_repository* repo,
+                    const char* refName,
+                    std::ostream& out,
+                    Options& options);
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <memory>
+#include <git2.h>
+#include <git2/sys/commit_graph.h>
+#include <git2/sys/midx.h>
+
+// Move-only owners of libgit2 handles. Each one frees its handle with the
+// matching git_*_free when it goes out of scope; functions that only use
+// a handle keep taking the raw pointer (get()).
+template <typename T, void (*Free)(T*)>
+struct GitFree {
+  void operator()(T* handle) const { Free(handle); }
+};
+
+template <typename T, void (*Free)(T*)>
+using GitPtr = std::unique_ptr<T, GitFree<T, Free>>;
+
+typedef GitPtr<::git_repository, ::git_repository_free> RepositoryPtr;
+typedef GitPtr<::git_worktree, ::git_worktree_free> WorktreePtr;
+typedef GitPtr<::git_config, ::git_config_free> ConfigPtr;
+typedef GitPtr<::git_config_entry, ::git_config_entry_free> ConfigEntryPtr;
+typedef GitPtr<::git_signature, ::git_signature_free> SignaturePtr;
+typedef GitPtr<::git_index, ::git_index_free> IndexPtr;
+typedef GitPtr<::git_odb, ::git_odb_free> OdbPtr;
+typedef GitPtr<::git_object, ::git_object_free> ObjectPtr;
+typedef GitPtr<::git_commit, ::git_commit_free> CommitPtr;
+typedef GitPtr<::git_annotated_commit,
+               ::git_annotated_commit_free> AnnotatedCommitPtr;
+typedef GitPtr<::git_tree, ::git_tree_free> TreePtr;
+typedef GitPtr<::git_tree_entry, ::git_tree_entry_free> TreeEntryPtr;
+typedef GitPtr<::git_blob, ::git_blob_free> BlobPtr;
+typedef GitPtr<::git_diff, ::git_diff_free> DiffPtr;
+typedef GitPtr<::git_patch, ::git_patch_free> PatchPtr;
+typedef GitPtr<::git_reference, ::git_reference_free> ReferencePtr;
+typedef GitPtr<::git_reference_iterator,
+               ::git_reference_iterator_free> ReferenceIteratorPtr;
+typedef GitPtr<::git_revwalk, ::git_revwalk_free> RevwalkPtr;
+typedef GitPtr<::git_remote, ::git_remote_free> RemotePtr;
+typedef GitPtr<::git_packbuilder, ::git_packbuilder_free> PackbuilderPtr;
+typedef GitPtr<::git_commit_graph_writer,
+               ::git_commit_graph_writer_free> CommitGraphWriterPtr;
+typedef GitPtr<::git_midx_writer, ::git_midx_writer_free> MidxWriterPtr;
+
+// Lets an owner receive a libgit2 out parameter:
+//   RepositoryPtr repo;
+//   m_giterror(::git_repository_open(outPtr(repo), path), ...);
+// The owner takes the handle at the end of the full expression.
+template <typename Owner>
+class OutPtr {
+public:
+  explicit OutPtr(Owner& owner) : owner(owner), handle(nullptr) { }
+  OutPtr(const OutPtr&) = delete;
+  OutPtr& operator=(const OutPtr&) = delete;
+  ~OutPtr() { owner.reset(handle); }
+  operator typename Owner::pointer*() { return &handle; }
+
+private:
+  Owner& owner;
+  typename Owner::pointer handle;
+};
+
+template <typename Owner>
+OutPtr<Owner>
+outPtr(Owner& owner) {
+  return OutPtr<Owner>(owner);
+}
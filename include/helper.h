@@ -7,7 +7,15 @@
 #include <sstream>
 #include <regex>
 #include <map>
+#include <memory>
+#include <vector>
 #include <git2.h>
+#include "gitptr.h"
+#include "ignore.h"
+#include "statcache.h"
+#include "compare.h"
+#include "diffindex.h"
+#include "log.h"
 
 namespace fs = std::filesystem;
 
@@ -16,7 +24,30 @@ struct Options {
   bool debug;
   int pagesProcessed;
   fs::path targetPath;
-  Options() : upload(false), debug(false), targetPath(), pagesProcessed(-1) { }
+  int entriesPruned;
+  size_t statCacheHits;
+  int lookahead;
+  bool deterministic;
+  long long epoch;
+  std::string fastImportFile;
+  std::string bundleFile;
+  std::string bundleBasis;
+  bool resume;
+  int resumePage;
+  std::string metricsFile;
+  int ioThreads;
+  bool multiPackIndex;
+  size_t maxMemory;
+  std::string archivesDir;
+  std::string diffIndexFile;
+  LogLevel verbosity;
+  Options() : upload(false), debug(false), targetPath(), pagesProcessed(-1),
+              entriesPruned(0), statCacheHits(0), lookahead(2), deterministic(false),
+              epoch(0), fastImportFile(), bundleFile(), bundleBasis(),
+              resume(false), resumePage(0), metricsFile(),
+              ioThreads(1),
+              multiPackIndex(false), maxMemory(0), archivesDir(),
+              diffIndexFile(), verbosity(LOG_INFO) { }
 };
 
 enum CheckoutType { BRANCH, TAG };
@@ -26,10 +57,12 @@ struct RepoDesc {
   std::string host;
   std::string user;
   std::string repoName;
+  std::string port;
+  std::string path;
   fs::path repoDir;
   CheckoutType checkoutType;
   std::string checkoutName;
-  ::git_repository *repo;
+  RepositoryPtr repo;
   RepoDesc(std::string protocol,
            std::string host,
            std::string user,
@@ -38,14 +71,50 @@ struct RepoDesc {
     host(host),
     user(user),
     repoName(repoName),
+    port(),
+    path(),
     repoDir(""),
     checkoutType(BRANCH),
     checkoutName("main"),
-    repo(nullptr)
+    repo()
     { }
 };
 
-void processStoryFile(Options& options);
+// A libgit2 error caught on a pipeline stage and reported by the writer.
+// libgit2 keeps the last error of each thread, so its text travels along.
+struct GitFailure {
+  int error;
+  int klass;
+  std::string reason;
+  std::string message;
+  GitFailure() : error(GIT_OK), klass(0), reason(), message() { }
+  GitFailure(int error, const std::string& message);
+};
+
+// Every ref of a repository peeled to its commit, built once so all the
+// tag: and branch: keys of a story resolve without further lookups.
+class RefIndex {
+public:
+  RefIndex() : repo(nullptr) { }
+  int build(::git_repository* repo);
+  bool resolve(const std::string& name, ::git_oid* oid) const;
+
+private:
+  ::git_repository* repo;
+  std::map<std::string, ::git_oid> refs;
+  std::map<std::string, ::git_oid> remoteBranches;
+};
+
+// "-" names the standard output as the file of an export
+extern const char* STDOUTFILENAME;
+
+// Protocol of the RepoDesc of a local path or a file:// URL
+extern const char* FILE_PROTOCOL;
+
+// Builds the story.md of storyDir into storyDir/target and returns the
+// exit status. The working directory is restored, so a process can build
+// any number of stories.
+int processStoryFile(const fs::path& storyDir, Options& options);
 std::string transTex2HTMLEntity(const std::string& input);
 void addBuffer2GitRepo(::git_repository* repo,
                        std::ostringstream* pBuffer,
@@ -66,47 +135,88 @@ void addPath2GitRepo(::git_repository *repo,
 void removePath2GitRepo(::git_repository *repo,
                         const fs::path& filePath,
                         Options& options);
+// The files of the directory in the index are added to removed
 void removeDir2GitRepo(::git_repository* repo,
                        const char* dirName,
+                       ChangeList& removed,
                        Options& options);
+// Lets repo read the objects of source during the build, so files copied
+// from a source checkout are staged without storing their blobs again
+void addObjectAlternate(::git_repository* repo,
+                        ::git_repository* source,
+                        Options& options);
+// Copies every object reachable from refName into a pack of repo, so it
+// no longer needs the alternates once the sources are gone
+void packReachableObjects(::git_repository* repo,
+                          const char* refName,
+                          Options& options);
+// Writes objects/info/commit-graph for the commits reachable from
+// refName, so history walks do not have to parse every commit
+int writeCommitGraph(::git_repository* repo,
+                     const char* refName);
+// Indexes every pack of repo in one objects/pack/multi-pack-index
+int writeMultiPackIndex(::git_repository* repo);
 void moveFile2GitRepo(::git_repository *repo,
                       const fs::path& srcPath,
                       const fs::path& dstPath,
                       Options& options);
 void commitGitRepo(::git_repository* repo,
                    std::string& message,
-                   Options& options);
+                   Options& options,
+                   int pageNumber = 0);
 void m_giterror(int error,
                 const char *msg,
                 Options options);
+void m_giterror(const GitFailure& failure,
+                Options options);
 int cloneGitRepo(fs::path& location,
                  std::string& url,
                  RepoDesc* rd,
-                 Options& options);
-int checkoutGitRepoFromName(::git_repository* repo,
-                            const std::string& tag,
-                            Options& options);
+                 Options& options,
+                 bool checkout = true);
+int addWorktree(RepositoryPtr& worktreeRepo,
+                ::git_repository* repo,
+                const std::string& name,
+                const fs::path& path);
+int checkoutWorktree(::git_repository* worktree,
+                     const ::git_oid& commitId,
+                     const std::string& repoName,
+                     Options& options,
+                     const std::vector<std::string>& paths);
 int pushGitRepo(::git_repository* repo,
                 Options& options,
                 const char* refSpec,
                 bool force = false);
-RepoDesc* url2RepoDesc(std::string& url);
+std::unique_ptr<RepoDesc> url2RepoDesc(std::string& url);
 void diffDirAction(::git_repository* repo,
                    fs::path srcDir,
                    fs::path dstDir,
+                   const IgnoreRules& ignoreRules,
+                   StatCache& statCache,
+                   CompareEngine& compareEngine,
+                   ChangeList& changes,
                    Options& options,
-                   bool isRoot = false);
+                   bool isRoot = false,
+                   fs::path relDir = fs::path());
+// True when both files hold the same characters, blanks aside
+bool diffFiles(fs::path file1,
+               fs::path file2);
 void stopProcessing(int pagesProcessed,
                     int commitDone,
                     Options& options);
-::git_repository* initLocalRepository(fs::path& repoPath,
-                                      Options& options);
-::git_commit* getFirstCommitOid(::git_repository* repo,
-                                Options& options);
+void shutdownGitLibrary(Options& options);
+// Splits a memory budget between the object cache and the pack windows
+// of libgit2, which are shared by every repository of the process
+void limitGitMemory(size_t budget, Options& options);
+RepositoryPtr initLocalRepository(fs::path& repoPath,
+                                  Options& options);
+CommitPtr getFirstCommitOid(::git_repository* repo,
+                            Options& options);
 void resetUntilFirstCommit(::git_repository *repo,
                            ::git_commit *firstCommit,
                            Options& options);
 void commitAmendGitRepo(::git_repository* repo,
                         std::string& message,
                         ::git_commit *firstCommit,
-                        Options& options);
+                        Options& options,
+                        int pageNumber = 0);
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+struct IgnorePattern {
+  std::string glob;
+  bool negated;
+  bool dirOnly;
+  bool anchored;
+  IgnorePattern(std::string glob,
+                bool negated,
+                bool dirOnly,
+                bool anchored) :
+    glob(glob),
+    negated(negated),
+    dirOnly(dirOnly),
+    anchored(anchored)
+    { }
+};
+
+// Gitignore-style exclusion rules read from .md2csignore files. Paths
+// are matched relative to the root of the source repository, and the
+// last matching pattern decides, so later files can re-include with '!'.
+// A scope set with limitTo() excludes everything outside its prefixes,
+// except the directories leading to them. A directory given to protect()
+// is ignored, and the directories leading to it are never removed as a
+// whole, only what they hold besides it.
+class IgnoreRules {
+public:
+  bool load(const fs::path& ignoreFile);
+  void add(const std::string& line);
+  void limitTo(const std::vector<std::string>& prefixes);
+  void protect(const std::string& dir);
+  bool isIgnored(const fs::path& relPath, bool isDir) const;
+  bool leadsToProtected(const fs::path& relDir) const;
+  bool empty() const { return patterns.empty() and scope.empty(); }
+
+private:
+  bool inScope(const std::string& path, bool isDir) const;
+  std::vector<IgnorePattern> patterns;
+  std::vector<std::string> scope;
+  std::vector<std::string> protectedDirs;
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <type_traits>
+
+namespace fs = std::filesystem;
+
+// -q shows errors and warnings, -d adds the debug lines
+enum LogLevel { LOG_ERROR, LOG_WARNING, LOG_INFO, LOG_DEBUG };
+
+// Messages of the build. Callers only queue text; a background thread
+// writes the queue a batch at a time and flushes once per batch, so a
+// page never waits for the terminal. Errors and warnings go to stderr,
+// the rest to stdout. Before start() and after stop() text is written
+// directly.
+class Log {
+public:
+  static void start(LogLevel verbosity);
+  static void stop();
+  // Returns once everything queued so far is written
+  static void flush();
+  static bool enabled(LogLevel level);
+  // Written as is, the text carries its own line ends
+  static void write(LogLevel level, const std::string& text);
+};
+
+// One message followed by key=value fields, queued when it goes out of
+// scope:
+//   LogLine(LOG_INFO, "Cloning").field("url", url).field("location", dir);
+// Nothing is formatted when the level is not shown.
+class LogLine {
+public:
+  LogLine(LogLevel level, const std::string& message);
+  LogLine(const LogLine&) = delete;
+  LogLine& operator=(const LogLine&) = delete;
+  ~LogLine();
+
+  LogLine& field(const char* key, const std::string& value);
+  LogLine& field(const char* key, const char* value) {
+    return enabled ? field(key, std::string(value)) : *this;
+  }
+  LogLine& field(const char* key, const fs::path& value) {
+    return enabled ? field(key, value.string()) : *this;
+  }
+  template <typename T,
+            typename = std::enable_if_t<std::is_arithmetic<T>::value>>
+  LogLine& field(const char* key, T value) {
+    return enabled ? field(key, std::to_string(value)) : *this;
+  }
+  LogLine& field(const char* key, bool value) {
+    return enabled ? field(key, std::string(value ? "yes" : "no")) : *this;
+  }
+
+private:
+  LogLevel level;
+  bool enabled;
+  std::string text;
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+enum MetricId {
+  FILES_LISTED,
+  FILES_COMPARED,
+  FILES_COPIED,
+  FILES_REMOVED,
+  BYTES_COMPARED,
+  INDEX_WRITES,
+  BLOBS_WRITTEN,
+  TREES_WRITTEN,
+  COMMITS_CREATED,
+  CLONE_BYTES,
+  PUSH_BYTES,
+  METRIC_COUNT
+};
+
+// Volume counters of a run. Any thread may add to them; they are only
+// statistics, so relaxed atomics are enough. endPage() keeps what each
+// counter moved during a page, and write() saves the run and its pages
+// in the Prometheus text format for node_exporter's textfile collector.
+class Metrics {
+public:
+  static void add(MetricId id, uint64_t amount = 1) {
+    counters[id].fetch_add(amount, std::memory_order_relaxed);
+  }
+  static uint64_t value(MetricId id) {
+    return counters[id].load(std::memory_order_relaxed);
+  }
+  static void endPage(int page);
+  static bool write(const fs::path& file);
+  // Starts the counters and pages of another run of the same process
+  static void reset();
+
+private:
+  typedef std::array<uint64_t, METRIC_COUNT> Values;
+
+  static std::atomic<uint64_t> counters[METRIC_COUNT];
+  static std::mutex mutex;
+  static Values pageStart;
+  static std::vector<std::pair<int, Values>> pages;
+};
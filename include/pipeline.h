@@ -0,0 +1,269 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "helper.h"
+
+// Fixed-capacity FIFO connecting two pipeline stages. push() blocks
+// while the queue is full, so a fast producer cannot run arbitrarily
+// far ahead of its consumer.
+template <typename T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity) :
+    capacity(capacity > 0 ? capacity : 1),
+    closed(false)
+    { }
+
+  void push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [this] { return items.size() < capacity; });
+    items.push_back(std::move(item));
+    notEmpty.notify_one();
+  }
+
+  // Returns false once the queue is closed and drained
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notEmpty.wait(lock, [this] { return !items.empty() or closed; });
+    if (items.empty()) return false;
+    item = std::move(items.front());
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    notEmpty.notify_all();
+  }
+
+private:
+  size_t capacity;
+  bool closed;
+  std::deque<T> items;
+  std::mutex mutex;
+  std::condition_variable notFull;
+  std::condition_variable notEmpty;
+};
+
+// Runs the items of one batch at a time on a fixed pool of threads, so
+// their system calls overlap instead of running one after the other. The
+// caller takes part in every batch, and with one thread, or fewer items
+// than minBatch, it runs them all itself. Items only write what belongs
+// to their own index.
+class BatchPool {
+public:
+  BatchPool(size_t threads, size_t minBatch) :
+    minBatch(minBatch),
+    task(nullptr),
+    count(0),
+    next(0),
+    done(0),
+    batch(0),
+    stopping(false) {
+    for (size_t i = 1; i < threads; i++)
+      workers.emplace_back(&BatchPool::work, this);
+  }
+
+  ~BatchPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    started.notify_all();
+
+    for (auto& worker : workers)
+      worker.join();
+  }
+
+  BatchPool(const BatchPool&) = delete;
+  BatchPool& operator=(const BatchPool&) = delete;
+
+  // Calls task(i) for every i below count, returns once all are done
+  void run(size_t count, const std::function<void(size_t)>& task) {
+    if (workers.empty() or count < minBatch) {
+      for (size_t i = 0; i < count; i++)
+        task(i);
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      this->task = &task;
+      this->count = count;
+      next = 0;
+      done = 0;
+      batch++;
+    }
+    started.notify_all();
+
+    drain();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [this]() { return done == this->count; });
+    this->task = nullptr;
+  }
+
+private:
+  // Takes items of the current batch until none is left. The batch cannot
+  // end, nor its task go away, while an item taken here is not done.
+  void drain() {
+    for (;;) {
+      const std::function<void(size_t)>* current;
+      size_t i;
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!task or next >= count)
+          return;
+        current = task;
+        i = next++;
+      }
+
+      (*current)(i);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (++done == count)
+        finished.notify_all();
+    }
+  }
+
+  void work() {
+    unsigned long seen = 0;
+
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        started.wait(lock, [&]() { return stopping or batch != seen; });
+        if (stopping)
+          return;
+        seen = batch;
+      }
+
+      drain();
+    }
+  }
+
+  size_t minBatch;
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable started;
+  std::condition_variable finished;
+  const std::function<void(size_t)>* task;
+  size_t count;
+  size_t next;
+  size_t done;
+  unsigned long batch;
+  bool stopping;
+};
+
+// A scratch working tree (a git worktree) of one source repository
+struct SourceTree {
+  fs::path dir;
+  RepositoryPtr repo;
+  SourceTree(fs::path dir,
+             RepositoryPtr repo) :
+    dir(dir),
+    repo(std::move(repo))
+    { }
+};
+
+// The source trees of one repository. Their number is the lookahead:
+// how many pages of that repository can be checked out ahead of the
+// writer, which also bounds the disk they use.
+class SourceTreePool {
+public:
+  explicit SourceTreePool(size_t capacity) :
+    capacity(capacity > 0 ? capacity : 1),
+    created(0)
+    { }
+
+  // Blocks while every tree is in use. Returns nullptr when the caller
+  // should create a new tree and hand it to own().
+  SourceTree* acquire() {
+    std::unique_lock<std::mutex> lock(mutex);
+    released.wait(lock, [this] { return !trees.empty() or
+                                        created < capacity; });
+    if (trees.empty()) {
+      created++;
+      return nullptr;
+    }
+    SourceTree* tree = trees.front();
+    trees.pop_front();
+    return tree;
+  }
+
+  SourceTree* own(std::unique_ptr<SourceTree> tree) {
+    std::lock_guard<std::mutex> lock(mutex);
+    owned.push_back(std::move(tree));
+    return owned.back().get();
+  }
+
+  void release(SourceTree* tree) {
+    std::lock_guard<std::mutex> lock(mutex);
+    trees.push_back(tree);
+    released.notify_one();
+  }
+
+  // Frees the trees once their repository has no pages left. Every tree
+  // must have been released, and none is acquired afterwards.
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    trees.clear();
+    owned.clear();
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return created;
+  }
+
+private:
+  size_t capacity;
+  size_t created;
+  std::deque<SourceTree*> trees;
+  std::vector<std::unique_ptr<SourceTree>> owned;
+  std::mutex mutex;
+  std::condition_variable released;
+};
+
+// One page of story.md as it travels through the pipeline. The parser
+// fills the header keys and the escaped content, the materializer checks
+// out the page's source tree, and the writer commits it and gives the
+// tree back to its pool, or closes the pool after the last page of its
+// repository. A page whose checkout failed carries the failure instead of
+// a tree, and is the last one the materializer hands out.
+struct StoryPage {
+  int number;
+  bool isLast;
+  std::vector<std::string> repositories;
+  std::string origin;
+  CheckoutType checkoutType;
+  std::string checkoutName;
+  std::vector<std::string> paths;
+  std::vector<std::string> assets;
+  std::string content;
+  std::string message;
+  SourceTree* source;
+  SourceTreePool* sourcePool;
+  bool lastOfSource;
+  GitFailure failure;
+  StoryPage() :
+    number(0),
+    isLast(false),
+    checkoutType(BRANCH),
+    source(nullptr),
+    sourcePool(nullptr),
+    lastOfSource(false),
+    failure()
+    { }
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <git2.h>
+
+// Totals of every clone, checkout and push of one repository
+struct Throughput {
+  size_t objects;
+  size_t bytes;
+  size_t files;
+  double transferSeconds;
+  double checkoutSeconds;
+  Throughput() :
+    objects(0),
+    bytes(0),
+    files(0),
+    transferSeconds(0.0),
+    checkoutSeconds(0.0)
+    { }
+};
+
+// Progress of one clone, checkout or push. libgit2 callbacks only update
+// counters here; a line is drawn at most every REFRESH_INTERVAL, and only
+// when stdout is a terminal. finish() adds the operation to the totals of
+// its repository, which report() prints at the end of the run; only its
+// first call counts.
+class ProgressMeter {
+public:
+  explicit ProgressMeter(const std::string& name);
+
+  void transfer(const ::git_indexer_progress* stats);
+  void push(unsigned int current, unsigned int total, size_t bytes);
+  void checkout(size_t completed, size_t total);
+  void sideband(const char* str, int len);
+  void finish();
+
+  static void report(std::ostream& out);
+  // Forgets the totals of a previous run of the same process
+  static void reset();
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  void render(bool force);
+
+  std::string name;
+  std::string remoteMessage;
+  ::git_indexer_progress stats;
+  size_t pushedObjects;
+  size_t pushTotal;
+  size_t pushedBytes;
+  size_t checkedOut;
+  size_t checkoutTotal;
+  bool transferring;
+  bool checkingOut;
+  bool rendered;
+  bool finished;
+  Clock::time_point started;
+  Clock::time_point transferEnd;
+  Clock::time_point checkoutStart;
+  Clock::time_point checkoutEnd;
+  Clock::time_point lastRender;
+
+  static std::mutex mutex;
+  static std::map<std::string, Throughput> totals;
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <atomic>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+struct FileStat {
+  off_t size;
+  struct timespec mtime;
+  struct timespec ctime;
+  ino_t ino;
+  dev_t dev;
+  FileStat() : size(0), mtime(), ctime(), ino(0), dev(0) { }
+};
+
+// Metadata of source and story files that held the same content when they
+// were last synchronized. While neither file's size, mtime, ctime or inode
+// changes, reconciliation can trust them without reading either one.
+// Like git's index, a file modified in the second it was recorded is racy:
+// its entry is kept but not trusted until it is compared again.
+// unchanged() may be called from several threads while nothing is stored.
+class StatCache {
+public:
+  bool unchanged(const fs::path& srcFile, const fs::path& dstFile) const;
+  void store(const fs::path& srcFile, const fs::path& dstFile);
+  size_t hits() const { return nHits.load(std::memory_order_relaxed); }
+
+private:
+  struct Entry {
+    FileStat src;
+    FileStat dst;
+    bool racy;
+  };
+  static std::string key(const fs::path& srcFile, const fs::path& dstFile);
+  std::unordered_map<std::string, Entry> entries;
+  mutable std::atomic<size_t> nHits { 0 };
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+#include "pipeline.h"
+
+namespace fs = std::filesystem;
+
+// A stretch of a story file: from a page header to the next one, or the
+// lines before the first header and around an include. Its lines are
+// already escaped, and the header keys are kept apart from the content.
+struct PartChunk {
+  bool startsPage;
+  std::string opening;
+  std::vector<std::string> repositories;
+  std::string origin;
+  bool hasCheckout;
+  CheckoutType checkoutType;
+  std::string checkoutName;
+  std::vector<std::string> paths;
+  std::vector<std::string> assets;
+  std::string content;
+  bool hasTitle;
+  std::string title;
+  std::string include;
+  PartChunk() : startsPage(false), hasCheckout(false), checkoutType(BRANCH),
+                hasTitle(false) { }
+};
+
+// story.md or one of the files it includes
+struct StoryPart {
+  fs::path file;
+  std::string digest;
+  std::vector<PartChunk> chunks;
+  std::string tail;
+  bool readable;
+  bool cached;
+  StoryPart() : readable(false), cached(false) { }
+};
+
+// story.md and every file included with a <!-- include: file --> line,
+// each parsed once. The files of each include level are read and parsed
+// in parallel; a file whose content was parsed before is taken from the
+// cache directory instead. Pages are numbered only when they are handed
+// out, in story order.
+class StoryParts {
+public:
+  bool load(const fs::path& storyFile, const fs::path& cacheDir);
+  void pages(BoundedQueue<StoryPage>& parsedPages, Options& options) const;
+  // Changes whenever story.md or any included file changes
+  std::string digest() const;
+  size_t size() const { return order.size(); }
+  size_t cachedParts() const;
+
+private:
+  struct Builder;
+  bool append(const StoryPart& part,
+              Builder& builder,
+              BoundedQueue<StoryPage>& parsedPages,
+              Options& options) const;
+  bool hasCycle(const fs::path& file, std::vector<fs::path>& chain) const;
+  fs::path root;
+  std::map<fs::path, StoryPart> parts;
+  std::vector<fs::path> order;
+};
+
+std::string contentDigest(const std::string& content);
@@ -0,0 +1,329 @@
+#include "archive.h"
+#include "atomicfile.h"
+#include <cstdio>
+#include <cstring>
+#include <zlib.h>
+
+const static size_t TAR_BLOCK { 512 };
+const static size_t TAR_CHUNK { 1 << 18 };
+const static size_t TAR_CHUNKS { 4 };
+const static size_t GZIP_CHUNK { 1 << 16 };
+
+struct TarHeader {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char checksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char padding[12];
+};
+
+static void
+octal(char* field, size_t size, unsigned long long value) {
+  ::snprintf(field, size, "%0*llo", static_cast<int>(size - 1), value);
+}
+
+// Appends to the tar of one archive and hands it on to its stream in
+// chunks of TAR_CHUNK bytes
+class TarWriter {
+public:
+  explicit TarWriter(ArchiveStream& stream) :
+    stream(stream),
+    written(0)
+    { }
+
+  void append(const char* data, size_t size) {
+    while (size > 0) {
+      size_t part = std::min(size, TAR_CHUNK - chunk.size());
+      chunk.append(data, part);
+      data += part;
+      size -= part;
+      written += part;
+
+      if (chunk.size() == TAR_CHUNK) {
+        stream.chunks.push(std::move(chunk));
+        chunk.clear();
+      }
+    }
+  }
+
+  void append(const std::string& data) {
+    append(data.data(), data.size());
+  }
+
+  void appendZeros(size_t size) {
+    append(std::string(size, '\0'));
+  }
+
+  void padBlock() {
+    appendZeros((TAR_BLOCK - written % TAR_BLOCK) % TAR_BLOCK);
+  }
+
+  void close() {
+    if (!chunk.empty())
+      stream.chunks.push(std::move(chunk));
+    stream.chunks.close();
+  }
+
+private:
+  ArchiveStream& stream;
+  std::string chunk;
+  size_t written;
+};
+
+static void
+appendHeader(TarWriter& tar,
+             const std::string& name,
+             char typeflag,
+             unsigned int mode,
+             size_t size,
+             long long mtime,
+             const std::string& linkname) {
+  TarHeader header;
+  ::memset(&header, 0, sizeof header);
+  ::strncpy(header.name, name.c_str(), sizeof header.name);
+  octal(header.mode, sizeof header.mode, mode);
+  octal(header.uid, sizeof header.uid, 0);
+  octal(header.gid, sizeof header.gid, 0);
+  octal(header.size, sizeof header.size, size);
+  octal(header.mtime, sizeof header.mtime, mtime);
+  header.typeflag = typeflag;
+  ::strncpy(header.linkname, linkname.c_str(), sizeof header.linkname);
+  ::memcpy(header.magic, "ustar", 6);
+  ::memcpy(header.version, "00", 2);
+
+  ::memset(header.checksum, ' ', sizeof header.checksum);
+  unsigned int sum = 0;
+  const unsigned char* bytes = reinterpret_cast<unsigned char*>(&header);
+  for (size_t i = 0; i < sizeof header; i++)
+    sum += bytes[i];
+  ::snprintf(header.checksum, sizeof header.checksum, "%06o", sum);
+
+  tar.append(reinterpret_cast<const char*>(&header), sizeof header);
+}
+
+static std::string
+paxRecord(const char* key, const std::string& value) {
+  // The length counts its own digits
+  size_t length = std::strlen(key) + value.size() + 3;
+  size_t total = length + std::to_string(length).size();
+  if (std::to_string(total).size() != std::to_string(length).size())
+    total++;
+  return std::to_string(total) + ' ' + key + '=' + value + '\n';
+}
+
+// Names and link targets longer than ustar allows go in a pax header
+static void
+appendEntry(TarWriter& tar,
+            const std::string& name,
+            char typeflag,
+            unsigned int mode,
+            const char* data,
+            size_t size,
+            long long mtime,
+            const std::string& linkname = std::string()) {
+  std::string records;
+  if (name.size() >= sizeof TarHeader::name)
+    records += paxRecord("path", name);
+  if (linkname.size() >= sizeof TarHeader::linkname)
+    records += paxRecord("linkpath", linkname);
+
+  if (!records.empty()) {
+    appendHeader(tar, "pax_header", 'x', 0644, records.size(), mtime, "");
+    tar.append(records);
+    tar.padBlock();
+  }
+
+  appendHeader(tar, name, typeflag, mode, size, mtime, linkname);
+  tar.append(data, size);
+  tar.padBlock();
+}
+
+struct TarWalk {
+  ::git_repository* repo;
+  TarWriter* tar;
+  long long mtime;
+  int error;
+};
+
+static int
+tarEntry(const char* root, const ::git_tree_entry* entry, void* payload) {
+  TarWalk* walk = static_cast<TarWalk*>(payload);
+  std::string name { std::string(root) + ::git_tree_entry_name(entry) };
+  ::git_filemode_t mode = ::git_tree_entry_filemode(entry);
+
+  if (mode == GIT_FILEMODE_TREE) {
+    appendEntry(*walk->tar, name + "/", '5', 0755, nullptr, 0, walk->mtime);
+    return 0;
+  }
+
+  // Submodules are left out, as git archive does
+  if (mode == GIT_FILEMODE_COMMIT)
+    return 0;
+
+  BlobPtr blob;
+  if ((walk->error = ::git_blob_lookup(outPtr(blob),
+                                       walk->repo,
+                                       ::git_tree_entry_id(entry))) < 0)
+    return -1;
+
+  const char* data = static_cast<const char*>(::git_blob_rawcontent(blob.get()));
+  size_t size = static_cast<size_t>(::git_blob_rawsize(blob.get()));
+
+  if (mode == GIT_FILEMODE_LINK)
+    appendEntry(*walk->tar, name, '2', 0777, nullptr, 0, walk->mtime,
+                std::string(data, size));
+  else
+    appendEntry(*walk->tar, name, '0',
+                mode == GIT_FILEMODE_BLOB_EXECUTABLE ? 0755 : 0644,
+                data, size, walk->mtime);
+
+  return 0;
+}
+
+// Written atomically, a viewer never serves half an archive. The stream
+// is drained even when the file cannot be written, so its writer is never
+// left waiting.
+static bool
+gzipFile(ArchiveStream& tar, const fs::path& file) {
+  bool written = writeFileAtomically(file, [&](std::ostream& out) {
+    ::z_stream stream;
+    ::memset(&stream, 0, sizeof stream);
+    // 16 asks zlib for a gzip wrapper, without a file name or time
+    if (::deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                       15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      return false;
+
+    std::vector<char> buffer(GZIP_CHUNK);
+    std::string chunk;
+    int result = Z_OK;
+
+    while (out and result != Z_STREAM_END) {
+      bool more = tar.chunks.pop(chunk);
+      if (!more)
+        chunk.clear();
+      stream.next_in = reinterpret_cast<Bytef*>(&chunk[0]);
+      stream.avail_in = static_cast<uInt>(chunk.size());
+      int flush = more ? Z_NO_FLUSH : Z_FINISH;
+
+      do {
+        stream.next_out = reinterpret_cast<Bytef*>(buffer.data());
+        stream.avail_out = static_cast<uInt>(buffer.size());
+        result = ::deflate(&stream, flush);
+        out.write(buffer.data(), buffer.size() - stream.avail_out);
+      } while (stream.avail_out == 0 and out);
+    }
+
+    ::deflateEnd(&stream);
+    // A tree walk that failed halfway leaves no archive
+    return result == Z_STREAM_END and !tar.aborted;
+  });
+
+  std::string rest;
+  while (tar.chunks.pop(rest))
+    ;
+
+  return written;
+}
+
+ArchiveExporter::ArchiveExporter(const fs::path& dir, size_t threads) :
+  dir(dir),
+  jobs(std::max<size_t>(threads, 1)),
+  failed(false),
+  finished(false) {
+  fs::create_directories(dir);
+
+  for (size_t i = 0; i < std::max<size_t>(threads, 1); i++)
+    workers.emplace_back(&ArchiveExporter::compress, this);
+}
+
+ArchiveExporter::~ArchiveExporter() {
+  finish();
+}
+
+void
+ArchiveExporter::compress() {
+  ArchiveJob job;
+
+  while (jobs.pop(job))
+    if (!gzipFile(*job.stream, job.file))
+      failed = true;
+}
+
+int
+ArchiveExporter::add(::git_repository* repo,
+                     int page,
+                     const ::git_oid& commitId) {
+  CommitPtr commit;
+  TreePtr tree;
+  int error;
+
+  if ((error = ::git_commit_lookup(outPtr(commit), repo, &commitId)) < 0)
+    return error;
+  if ((error = ::git_commit_tree(outPtr(tree), commit.get())) < 0)
+    return error;
+
+  fs::path file { dir / ("page-" + std::to_string(page) + ".tar.gz") };
+  char treeId[GIT_OID_HEXSZ + 1];
+  ::git_oid_tostr(treeId, sizeof treeId, ::git_tree_id(tree.get()));
+
+  auto archive = archives.find(treeId);
+  if (archive != archives.end()) {
+    links.emplace_back(file, archive->second);
+    return 0;
+  }
+
+  // Handed to a compressor first, which takes the tar as it is walked
+  ArchiveJob job { file, std::make_shared<ArchiveStream>(TAR_CHUNKS) };
+  jobs.push(job);
+
+  TarWriter tar(*job.stream);
+  TarWalk walk { repo, &tar, ::git_commit_time(commit.get()), 0 };
+
+  if ((error = ::git_tree_walk(tree.get(),
+                               GIT_TREEWALK_PRE,
+                               tarEntry,
+                               &walk)) < 0) {
+    job.stream->aborted = true;
+    tar.close();
+    return walk.error < 0 ? walk.error : error;
+  }
+  tar.appendZeros(2 * TAR_BLOCK);
+  tar.close();
+
+  archives[treeId] = file;
+
+  return 0;
+}
+
+bool
+ArchiveExporter::finish() {
+  if (finished)
+    return !failed;
+  finished = true;
+
+  jobs.close();
+  for (auto& worker : workers)
+    worker.join();
+
+  for (const auto& link : links) {
+    std::error_code error;
+    fs::remove(link.first, error);
+    fs::create_hard_link(link.second, link.first, error);
+    if (error and !fs::copy_file(link.second, link.first, error))
+      failed = true;
+  }
+
+  return !failed;
+}
@@ -0,0 +1,247 @@
+#include "assets.h"
+#include "atomicfile.h"
+#include "gitptr.h"
+#include "metrics.h"
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+const static char* MANIFEST_VERSION { "md2cs-assets 1" };
+
+static bool
+statFile(const fs::path& file, FileStat& fileStat) {
+  struct stat st;
+  if (::lstat(file.c_str(), &st) != 0 or !S_ISREG(st.st_mode))
+    return false;
+
+  fileStat.size = st.st_size;
+  fileStat.mtime = st.st_mtim;
+  fileStat.ctime = st.st_ctim;
+  fileStat.ino = st.st_ino;
+  fileStat.dev = st.st_dev;
+  return true;
+}
+
+static bool
+sameStat(const FileStat& a, const FileStat& b) {
+  return a.size == b.size and
+    a.mtime.tv_sec == b.mtime.tv_sec and
+    a.mtime.tv_nsec == b.mtime.tv_nsec and
+    a.ctime.tv_sec == b.ctime.tv_sec and
+    a.ctime.tv_nsec == b.ctime.tv_nsec and
+    a.ino == b.ino;
+}
+
+// Like stageKnownBlob, the entry takes the metadata of the copy
+static int
+stageBlob(::git_index* index,
+          const fs::path& file,
+          const std::string& relPath,
+          const ::git_oid& id) {
+  struct stat st;
+  if (::lstat(file.c_str(), &st) != 0)
+    return -1;
+
+  ::git_index_entry entry;
+  ::memset(&entry, 0, sizeof entry);
+  entry.ctime.seconds = st.st_ctim.tv_sec;
+  entry.ctime.nanoseconds = st.st_ctim.tv_nsec;
+  entry.mtime.seconds = st.st_mtim.tv_sec;
+  entry.mtime.nanoseconds = st.st_mtim.tv_nsec;
+  entry.dev = st.st_dev;
+  entry.ino = st.st_ino;
+  entry.mode = st.st_mode & S_IXUSR ?
+    GIT_FILEMODE_BLOB_EXECUTABLE : GIT_FILEMODE_BLOB;
+  entry.uid = st.st_uid;
+  entry.gid = st.st_gid;
+  entry.file_size = static_cast<uint32_t>(st.st_size);
+  entry.id = id;
+  entry.path = relPath.c_str();
+
+  return ::git_index_add(index, &entry);
+}
+
+AssetSync::AssetSync(const fs::path& storyDir,
+                     const fs::path& manifestFile) :
+  storyDir(storyDir),
+  manifestFile(manifestFile),
+  nUnchanged(0) {
+  load();
+}
+
+void
+AssetSync::load() {
+  std::ifstream input(manifestFile);
+  std::string line;
+
+  if (!std::getline(input, line) or line != MANIFEST_VERSION)
+    return;
+
+  while (std::getline(input, line)) {
+    std::istringstream fields { line };
+    std::string id, path;
+    Entry entry;
+
+    fields >> id
+           >> entry.stat.size
+           >> entry.stat.mtime.tv_sec >> entry.stat.mtime.tv_nsec
+           >> entry.stat.ctime.tv_sec >> entry.stat.ctime.tv_nsec
+           >> entry.stat.ino
+           >> entry.racy;
+    std::getline(fields >> std::ws, path);
+
+    if (!fields.eof() or path.empty() or
+        ::git_oid_fromstr(&entry.id, id.c_str()) < 0)
+      continue;
+
+    manifest[path] = entry;
+  }
+}
+
+// Written atomically, an interrupted run leaves the last manifest
+bool
+AssetSync::save() const {
+  return writeFileAtomically(manifestFile, [this](std::ostream& out) {
+    out << MANIFEST_VERSION << '\n';
+    for (const auto& path : synced) {
+      const Entry& entry = manifest.at(path);
+      char id[GIT_OID_HEXSZ + 1];
+      ::git_oid_tostr(id, sizeof id, &entry.id);
+
+      out << id << ' '
+          << entry.stat.size << ' '
+          << entry.stat.mtime.tv_sec << ' ' << entry.stat.mtime.tv_nsec << ' '
+          << entry.stat.ctime.tv_sec << ' ' << entry.stat.ctime.tv_nsec << ' '
+          << entry.stat.ino << ' '
+          << entry.racy << ' '
+          << path << '\n';
+    }
+
+    return true;
+  });
+}
+
+// The id of a file's blob: from the manifest while its metadata holds,
+// otherwise by hashing the file, whose blob is written when it is new
+int
+AssetSync::contentId(::git_repository* repo,
+                     const fs::path& file,
+                     const std::string& relPath,
+                     ::git_oid& id) {
+  FileStat current;
+  if (!statFile(file, current))
+    return -1;
+
+  auto known = manifest.find(relPath);
+  if (known != manifest.end() and !known->second.racy and
+      sameStat(known->second.stat, current)) {
+    id = known->second.id;
+    return 0;
+  }
+
+  OdbPtr odb;
+  int error;
+
+  if ((error = ::git_odb_hashfile(&id, file.c_str(), GIT_OBJECT_BLOB)) < 0)
+    return error;
+  if ((error = ::git_repository_odb(outPtr(odb), repo)) < 0)
+    return error;
+
+  if (!::git_odb_exists(odb.get(), &id)) {
+    if ((error = ::git_blob_create_from_disk(&id, repo, file.c_str())) < 0)
+      return error;
+    Metrics::add(BLOBS_WRITTEN);
+  }
+
+  Entry& entry = manifest[relPath];
+  entry.id = id;
+  entry.stat = current;
+  entry.racy = current.mtime.tv_sec >= ::time(nullptr);
+
+  return 0;
+}
+
+int
+AssetSync::sync(::git_repository* repo,
+                const std::string& dir,
+                ChangeList& changes) {
+  IndexPtr index;
+  OdbPtr odb;
+  int error;
+
+  if ((error = ::git_repository_index(outPtr(index), repo)) < 0)
+    return error;
+  if ((error = ::git_repository_odb(outPtr(odb), repo)) < 0)
+    return error;
+
+  fs::path workdir { ::git_repository_workdir(repo) };
+  fs::path sourceDir { storyDir / dir };
+  std::string prefix { fs::path(dir).generic_string() + "/" };
+  std::set<std::string> present;
+
+  for (auto path = synced.lower_bound(prefix);
+       path != synced.end() and path->compare(0, prefix.size(), prefix) == 0; )
+    path = synced.erase(path);
+
+  for (const auto& file : fs::recursive_directory_iterator(sourceDir)) {
+    if (!file.is_regular_file() or file.is_symlink())
+      continue;
+
+    std::string relPath {
+      (fs::path(dir) / file.path().lexically_relative(sourceDir))
+        .generic_string() };
+    fs::path target { workdir / relPath };
+    ::git_oid id;
+
+    if ((error = contentId(repo, file.path(), relPath, id)) < 0)
+      return error;
+    present.insert(relPath);
+    synced.insert(relPath);
+
+    const ::git_index_entry* staged =
+      ::git_index_get_bypath(index.get(), relPath.c_str(), 0);
+    if (staged and ::git_oid_equal(&staged->id, &id) and fs::exists(target)) {
+      nUnchanged++;
+      continue;
+    }
+
+    // Taken from the manifest, the blob may be missing in a new repository
+    if (!::git_odb_exists(odb.get(), &id)) {
+      if ((error = ::git_blob_create_from_disk(&id,
+                                               repo,
+                                               file.path().c_str())) < 0)
+        return error;
+      Metrics::add(BLOBS_WRITTEN);
+    }
+
+    changes.emplace_back(relPath, staged ? FILE_MODIFIED : FILE_ADDED);
+    fs::create_directories(target.parent_path());
+    fs::copy_file(file.path(), target, fs::copy_options::overwrite_existing);
+    Metrics::add(FILES_COPIED);
+
+    if ((error = stageBlob(index.get(), target, relPath, id)) < 0)
+      return error;
+  }
+
+  // Files removed from the directory since the last page that had it
+  std::vector<std::string> removed;
+  for (size_t i = 0; i < ::git_index_entrycount(index.get()); i++) {
+    std::string path { ::git_index_get_byindex(index.get(), i)->path };
+    if (path.compare(0, prefix.size(), prefix) == 0 and !present.count(path))
+      removed.push_back(path);
+  }
+
+  for (const auto& path : removed) {
+    if ((error = ::git_index_remove_bypath(index.get(), path.c_str())) < 0)
+      return error;
+    changes.emplace_back(path, FILE_DELETED);
+    std::error_code ignored;
+    fs::remove(workdir / path, ignored);
+    Metrics::add(FILES_REMOVED);
+  }
+
+  Metrics::add(INDEX_WRITES);
+  return ::git_index_write(index.get());
+}
@@ -0,0 +1,32 @@
+#include "atomicfile.h"
+#include <atomic>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+
+bool
+writeFileAtomically(const fs::path& file,
+                    const std::function<bool(std::ostream&)>& write) {
+  static std::atomic<unsigned long> written { 0 };
+
+  fs::path temporary { file };
+  temporary += ".tmp." + std::to_string(::getpid()) + "." +
+    std::to_string(written++);
+
+  bool complete;
+  {
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    complete = out and write(out) and out.flush();
+  }
+
+  std::error_code error;
+  if (complete)
+    fs::rename(temporary, file, error);
+
+  if (!complete or error) {
+    fs::remove(temporary, error);
+    return false;
+  }
+
+  return true;
+}
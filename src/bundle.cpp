@@ -0,0 +1,90 @@
+#include "bundle.h"
+
+const static char* BUNDLE_SIGNATURE { "# v2 git bundle" };
+
+static std::string
+oidString(const ::git_oid* oid) {
+  char buffer[GIT_OID_HEXSZ + 1];
+  ::git_oid_tostr(buffer, sizeof buffer, oid);
+  return std::string { buffer };
+}
+
+static int
+writePackChunk(void* buffer,
+               size_t size,
+               void* payload) {
+  std::ostream* out = static_cast<std::ostream*>(payload);
+  out->write(static_cast<const char*>(buffer), size);
+  return out->good() ? 0 : -1;
+}
+
+int
+writeBundle(::git_repository* repo,
+            const char* refName,
+            const std::string& basis,
+            std::ostream& out,
+            Options& options) {
+  ::git_oid tip;
+
+  m_giterror(::git_reference_name_to_id(&tip, repo, refName),
+             "Cannot find the story branch",
+             options);
+
+  RevwalkPtr walk;
+  m_giterror(::git_revwalk_new(outPtr(walk), repo),
+             "Cannot create revision walk",
+             options);
+  m_giterror(::git_revwalk_push(walk.get(), &tip),
+             "Cannot walk the story branch",
+             options);
+
+  ObjectPtr prerequisite;
+  if (!basis.empty()) {
+    ObjectPtr object;
+    m_giterror(::git_revparse_single(outPtr(object), repo, basis.c_str()),
+               "Cannot find the bundle basis",
+               options);
+    m_giterror(::git_object_peel(outPtr(prerequisite),
+                                 object.get(),
+                                 GIT_OBJECT_COMMIT),
+               "Bundle basis is not a commit",
+               options);
+
+    m_giterror(::git_revwalk_hide(walk.get(),
+                                  ::git_object_id(prerequisite.get())),
+               "Cannot exclude the bundle basis",
+               options);
+  }
+
+  // Commits, trees and blobs reachable from the tip but not from the
+  // basis; libgit2 deltifies them while building the pack
+  PackbuilderPtr packbuilder;
+  m_giterror(::git_packbuilder_new(outPtr(packbuilder), repo),
+             "Cannot create pack builder",
+             options);
+  ::git_packbuilder_set_threads(packbuilder.get(), 0);
+  m_giterror(::git_packbuilder_insert_walk(packbuilder.get(), walk.get()),
+             "Cannot collect the bundle objects",
+             options);
+
+  out << BUNDLE_SIGNATURE << '\n';
+  if (prerequisite) {
+    ::git_commit* commit =
+      reinterpret_cast<::git_commit*>(prerequisite.get());
+    out << '-' << oidString(::git_commit_id(commit))
+        << ' ' << ::git_commit_summary(commit) << '\n';
+  }
+  out << oidString(&tip) << ' ' << refName << '\n'
+      << '\n';
+
+  int error = ::git_packbuilder_foreach(packbuilder.get(),
+                                        writePackChunk,
+                                        &out);
+  out.flush();
+
+  if (error == 0)
+    LogLine(LOG_INFO, "Bundle written")
+      .field("objects", ::git_packbuilder_object_count(packbuilder.get()));
+
+  return error < 0 or !out.good() ? -1 : 0;
+}
@@ -0,0 +1,91 @@
+#include "checkpoint.h"
+#include "atomicfile.h"
+#include <climits>
+#include <fstream>
+#include <sstream>
+
+const static char* CHECKPOINT_FILE    { "checkpoint" };
+const static char* CHECKPOINT_VERSION { "md2cs-checkpoint 1" };
+
+// A page number written by save(), false when the file is damaged
+static bool
+parsePage(const std::string& text, int& page) {
+  size_t end = 0;
+  long value = 0;
+
+  try {
+    value = std::stol(text, &end);
+  }
+  catch (const std::exception&) {
+    return false;
+  }
+
+  if (end != text.size() or value < 1 or value > INT_MAX)
+    return false;
+
+  page = static_cast<int>(value);
+  return true;
+}
+
+bool
+hasCheckpoint(const fs::path& targetPath) {
+  return fs::exists(targetPath / CHECKPOINT_FILE);
+}
+
+bool
+Checkpoint::load(const fs::path& targetPath) {
+  std::ifstream input(targetPath / CHECKPOINT_FILE);
+  std::string line;
+
+  if (!std::getline(input, line) or line != CHECKPOINT_VERSION)
+    return false;
+
+  refs.clear();
+  while (std::getline(input, line)) {
+    std::istringstream fields { line };
+    std::string key, value;
+    fields >> key >> value;
+
+    if (key == "story")
+      storyDigest = value;
+    else if (key == "page") {
+      if (!parsePage(value, page)) return false;
+    }
+    else if (key == "commit") {
+      if (::git_oid_fromstr(&commit, value.c_str()) < 0) return false;
+    }
+    else if (key == "force")
+      forcePush = value == "1";
+    else if (key == "ref") {
+      ::git_oid oid;
+      std::string repoName, name;
+      fields >> repoName;
+      std::getline(fields >> std::ws, name);
+      if (::git_oid_fromstr(&oid, value.c_str()) < 0) return false;
+      refs[std::make_pair(repoName, name)] = oid;
+    }
+  }
+
+  return page > 0;
+}
+
+// Written atomically, so a crash never leaves half a checkpoint
+bool
+Checkpoint::save(const fs::path& targetPath) const {
+  return writeFileAtomically(targetPath / CHECKPOINT_FILE,
+                             [this](std::ostream& output) {
+    char oid[GIT_OID_HEXSZ + 1];
+
+    output << CHECKPOINT_VERSION << '\n'
+           << "story " << storyDigest << '\n'
+           << "page " << page << '\n'
+           << "commit " << ::git_oid_tostr(oid, sizeof oid, &commit) << '\n'
+           << "force " << (forcePush ? 1 : 0) << '\n';
+
+    for (const auto& ref : refs)
+      output << "ref " << ::git_oid_tostr(oid, sizeof oid, &ref.second)
+             << ' ' << ref.first.first << ' ' << ref.first.second << '\n';
+
+    return true;
+  });
+}
@@ -0,0 +1,31 @@
+#include "compare.h"
+#include "helper.h"
+#include "pipeline.h"
+
+// Below this, handing the files to the workers costs more than it saves
+const static size_t MIN_PARALLEL_BATCH { 8 };
+
+static CompareResult
+compareFiles(const StatCache& statCache, const FilePair& files) {
+  if (statCache.unchanged(files.first, files.second))
+    return SAME_STAT;
+
+  return diffFiles(files.first, files.second) ? SAME_CONTENT : DIFFERENT;
+}
+
+CompareEngine::CompareEngine(size_t threads) :
+  pool(new BatchPool(threads, MIN_PARALLEL_BATCH))
+  { }
+
+// BatchPool is only complete here
+CompareEngine::~CompareEngine() = default;
+
+void
+CompareEngine::compare(const StatCache& statCache,
+                       const std::vector<FilePair>& files,
+                       std::vector<CompareResult>& results) {
+  results.assign(files.size(), DIFFERENT);
+
+  pool->run(files.size(),
+            [&](size_t i) { results[i] = compareFiles(statCache, files[i]); });
+}
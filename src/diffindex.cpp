@@ -0,0 +1,225 @@
+#include "diffindex.h"
+#include "atomicfile.h"
+#include "gitptr.h"
+#include "pipeline.h"
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+const static char* DIFF_INDEX_VERSION { "md2cs-diff-index 1" };
+const static char CHANGE_LETTERS[] { 'A', 'M', 'D' };
+
+// Below this, handing the files to the workers costs more than it saves
+const static size_t MIN_PARALLEL_BATCH { 4 };
+
+// libgit2 diffs two buffers without a repository, so the workers share
+// nothing with the writer
+static void
+diffStats(DiffIndex::Job& job) {
+  std::string after;
+  if (!job.after.empty()) {
+    std::ifstream input(job.after, std::ios::binary);
+    after.assign(std::istreambuf_iterator<char>(input),
+                 std::istreambuf_iterator<char>());
+  }
+
+  DiffIndex::FileStats& stats = *job.stats;
+  PatchPtr patch;
+  if (::git_patch_from_buffers(outPtr(patch),
+                               job.before.data(), job.before.size(),
+                               stats.path.c_str(),
+                               after.data(), after.size(),
+                               stats.path.c_str(),
+                               nullptr) < 0) {
+    ::git_error_clear();
+    stats.binary = true;
+    return;
+  }
+
+  if (::git_patch_get_delta(patch.get())->flags & GIT_DIFF_FLAG_BINARY) {
+    stats.binary = true;
+    return;
+  }
+
+  ::git_patch_line_stats(nullptr,
+                         &stats.additions,
+                         &stats.deletions,
+                         patch.get());
+}
+
+// A line count of the index, false when it is not one
+static bool
+parseCount(const std::string& text, size_t& count) {
+  size_t end = 0;
+
+  try {
+    count = std::stoul(text, &end);
+  }
+  catch (const std::exception&) {
+    return false;
+  }
+
+  return end == text.size();
+}
+
+// The content of path in tree, empty when it is not a blob there
+static std::string
+blobContent(::git_repository* repo,
+            ::git_tree* tree,
+            const std::string& path) {
+  TreeEntryPtr entry;
+  BlobPtr blob;
+
+  if (!tree)
+    return std::string();
+
+  // Each owner only takes its handle at the end of its own statement
+  if (::git_tree_entry_bypath(outPtr(entry), tree, path.c_str()) < 0) {
+    ::git_error_clear();
+    return std::string();
+  }
+
+  if (::git_tree_entry_type(entry.get()) != GIT_OBJECT_BLOB)
+    return std::string();
+
+  if (::git_blob_lookup(outPtr(blob),
+                        repo,
+                        ::git_tree_entry_id(entry.get())) < 0) {
+    ::git_error_clear();
+    return std::string();
+  }
+
+  return std::string(static_cast<const char*>(::git_blob_rawcontent(blob.get())),
+                     static_cast<size_t>(::git_blob_rawsize(blob.get())));
+}
+
+DiffIndex::DiffIndex(size_t threads) :
+  pool(new BatchPool(threads, MIN_PARALLEL_BATCH))
+  { }
+
+// BatchPool is only complete here
+DiffIndex::~DiffIndex() = default;
+
+int
+DiffIndex::add(::git_repository* repo,
+               int page,
+               const ::git_oid& commitId,
+               const ChangeList& changes) {
+  CommitPtr commit;
+  CommitPtr parent;
+  TreePtr tree;
+  int error;
+
+  if ((error = ::git_commit_lookup(outPtr(commit), repo, &commitId)) < 0)
+    return error;
+  if (::git_commit_parentcount(commit.get()) > 0) {
+    if ((error = ::git_commit_parent(outPtr(parent), commit.get(), 0)) < 0)
+      return error;
+    if ((error = ::git_commit_tree(outPtr(tree), parent.get())) < 0)
+      return error;
+  }
+
+  char id[GIT_OID_HEXSZ + 1];
+  ::git_oid_tostr(id, sizeof id, &commitId);
+  pages.push_back(Page { page, id, std::vector<FileStats>() });
+
+  std::vector<FileStats>& files = pages.back().files;
+  for (const auto& change : changes)
+    files.push_back(FileStats { change.type, change.path, false, 0, 0 });
+
+  // Only the writer reads the object database
+  fs::path workdir { ::git_repository_workdir(repo) };
+  std::vector<Job> pageJobs(files.size());
+  for (size_t i = 0; i < files.size(); i++) {
+    pageJobs[i].stats = &files[i];
+    if (files[i].type != FILE_ADDED)
+      pageJobs[i].before = blobContent(repo, tree.get(), files[i].path);
+    if (files[i].type != FILE_DELETED)
+      pageJobs[i].after = workdir / files[i].path;
+  }
+
+  pool->run(pageJobs.size(), [&](size_t i) { diffStats(pageJobs[i]); });
+
+  return 0;
+}
+
+bool
+DiffIndex::load(const fs::path& file, int lastPage) {
+  std::ifstream input(file);
+  std::string line;
+
+  if (!input)
+    return true;
+
+  if (!std::getline(input, line) or line != DIFF_INDEX_VERSION)
+    return false;
+
+  bool keep = false;
+  while (std::getline(input, line)) {
+    std::istringstream fields { line };
+    std::string tag;
+    std::getline(fields, tag, '\t');
+
+    if (tag == "page") {
+      Page page;
+      if (!(fields >> page.number >> page.commit))
+        return false;
+      keep = page.number <= lastPage;
+      if (keep)
+        pages.push_back(page);
+      continue;
+    }
+
+    if (!keep)
+      continue;
+
+    FileStats stats { FILE_ADDED, std::string(), false, 0, 0 };
+    bool known = false;
+    for (size_t type = 0; type < sizeof CHANGE_LETTERS; type++)
+      if (tag.size() == 1 and tag[0] == CHANGE_LETTERS[type]) {
+        stats.type = static_cast<ChangeType>(type);
+        known = true;
+      }
+
+    std::string additions, deletions;
+    std::getline(fields, additions, '\t');
+    std::getline(fields, deletions, '\t');
+    std::getline(fields, stats.path);
+
+    stats.binary = additions == "-" and deletions == "-";
+    if (!known or stats.path.empty() or
+        (!stats.binary and
+         !(parseCount(additions, stats.additions) and
+           parseCount(deletions, stats.deletions)))) {
+      // The page lost some of its files, it is left out with the rest
+      pages.pop_back();
+      return false;
+    }
+
+    pages.back().files.push_back(stats);
+  }
+
+  return true;
+}
+
+// Written atomically, a viewer never reads half an index
+bool
+DiffIndex::write(const fs::path& file) const {
+  return writeFileAtomically(file, [this](std::ostream& out) {
+    out << DIFF_INDEX_VERSION << '\n';
+    for (const auto& page : pages) {
+      out << "page\t" << page.number << '\t' << page.commit << '\n';
+
+      for (const auto& stats : page.files) {
+        out << CHANGE_LETTERS[stats.type] << '\t';
+        if (stats.binary)
+          out << "-\t-\t";
+        else
+          out << stats.additions << '\t' << stats.deletions << '\t';
+        out << stats.path << '\n';
+      }
+    }
+
+    return true;
+  });
+}
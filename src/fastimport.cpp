@@ -0,0 +1,181 @@
+#include "fastimport.h"
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+static std::string
+oidString(const ::git_oid* oid) {
+  char buffer[GIT_OID_HEXSZ + 1];
+  ::git_oid_tostr(buffer, sizeof buffer, oid);
+  return std::string { buffer };
+}
+
+// Paths are written unquoted unless fast-import would misread them
+static std::string
+quotePath(const char* path) {
+  std::string unquoted { path };
+  if (unquoted.find_first_of("\n\\") == std::string::npos and
+      unquoted.front() != '"')
+    return unquoted;
+
+  std::string quoted { "\"" };
+  for (char c : unquoted) {
+    switch (c) {
+    case '"':  quoted += "\\\""; break;
+    case '\\': quoted += "\\\\"; break;
+    case '\n': quoted += "\\n";  break;
+    default:   quoted += c;      break;
+    }
+  }
+  return quoted + "\"";
+}
+
+static void
+writeSignature(std::ostream& out,
+               const char* role,
+               const ::git_signature* signature) {
+  int offset = signature->when.offset;
+  char sign = offset < 0 ? '-' : '+';
+  if (offset < 0) offset = -offset;
+
+  char zone[8];
+  ::snprintf(zone, sizeof zone, "%c%02d%02d", sign, offset / 60, offset % 60);
+
+  out << role << ' '
+      << signature->name << " <" << signature->email << "> "
+      << signature->when.time << ' ' << zone << '\n';
+}
+
+static void
+writeData(std::ostream& out,
+          const char* data,
+          size_t size) {
+  out << "data " << size << '\n';
+  out.write(data, size);
+  out << '\n';
+}
+
+int
+writeFastImport(::git_repository* repo,
+                const char* refName,
+                std::ostream& out,
+                Options& options) {
+  RevwalkPtr walk;
+
+  m_giterror(::git_revwalk_new(outPtr(walk), repo),
+             "Cannot create revision walk",
+             options);
+  ::git_revwalk_sorting(walk.get(), GIT_SORT_TOPOLOGICAL | GIT_SORT_REVERSE);
+  ::git_revwalk_simplify_first_parent(walk.get());
+
+  m_giterror(::git_revwalk_push_ref(walk.get(), refName),
+             "Cannot find the story branch",
+             options);
+
+  std::map<std::string, size_t> blobMarks;
+  size_t nextMark = 1;
+  size_t parentMark = 0;
+  TreePtr parentTree;
+
+  out << "feature done\n"
+      << "reset " << refName << '\n';
+
+  ::git_oid commitId;
+  while (::git_revwalk_next(&commitId, walk.get()) == 0) {
+    CommitPtr commit;
+    TreePtr tree;
+    DiffPtr diff;
+
+    m_giterror(::git_commit_lookup(outPtr(commit), repo, &commitId),
+               "Cannot lookup commit",
+               options);
+    m_giterror(::git_commit_tree(outPtr(tree), commit.get()),
+               "Cannot lookup commit tree",
+               options);
+    m_giterror(::git_diff_tree_to_tree(outPtr(diff),
+                                       repo,
+                                       parentTree.get(),
+                                       tree.get(),
+                                       nullptr),
+               "Cannot diff commit trees",
+               options);
+
+    // Blobs go first, fast-import needs the marks before the commit.
+    // Deletions are applied before the files that may take their place:
+    // a file replacing a directory sorts before the directory's children.
+    std::vector<std::string> deleteCommands;
+    std::vector<std::string> fileCommands;
+    size_t nDeltas = ::git_diff_num_deltas(diff.get());
+
+    for (size_t i = 0; i < nDeltas; ++i) {
+      const ::git_diff_delta* delta = ::git_diff_get_delta(diff.get(), i);
+
+      if (delta->status == GIT_DELTA_DELETED) {
+        deleteCommands.push_back("D " + quotePath(delta->old_file.path));
+        continue;
+      }
+
+      char mode[8];
+      ::snprintf(mode, sizeof mode, "%06o", delta->new_file.mode);
+      std::string path { quotePath(delta->new_file.path) };
+
+      // Gitlinks point to commits of other repositories, not to blobs
+      if (delta->new_file.mode == GIT_FILEMODE_COMMIT) {
+        fileCommands.push_back(std::string("M ") + mode + ' ' +
+                               oidString(&delta->new_file.id) + ' ' + path);
+        continue;
+      }
+
+      std::string blobId { oidString(&delta->new_file.id) };
+      auto mark = blobMarks.find(blobId);
+
+      if (mark == blobMarks.end()) {
+        BlobPtr blob;
+        m_giterror(::git_blob_lookup(outPtr(blob),
+                                     repo,
+                                     &delta->new_file.id),
+                   "Cannot lookup blob",
+                   options);
+
+        out << "blob\n" << "mark :" << nextMark << '\n';
+        writeData(out,
+                  static_cast<const char*>(::git_blob_rawcontent(blob.get())),
+                  static_cast<size_t>(::git_blob_rawsize(blob.get())));
+
+        mark = blobMarks.emplace(blobId, nextMark++).first;
+      }
+
+      fileCommands.push_back(std::string("M ") + mode + " :" +
+                             std::to_string(mark->second) + ' ' + path);
+    }
+
+    size_t commitMark = nextMark++;
+    const char* message = ::git_commit_message_raw(commit.get());
+    const char* encoding = ::git_commit_message_encoding(commit.get());
+
+    out << "commit " << refName << '\n'
+        << "mark :" << commitMark << '\n';
+    writeSignature(out, "author", ::git_commit_author(commit.get()));
+    writeSignature(out, "committer", ::git_commit_committer(commit.get()));
+    if (encoding)
+      out << "encoding " << encoding << '\n';
+    writeData(out, message, ::strlen(message));
+    if (parentMark) out << "from :" << parentMark << '\n';
+    for (const auto& command : deleteCommands)
+      out << command << '\n';
+    for (const auto& command : fileCommands)
+      out << command << '\n';
+    out << '\n';
+
+    parentMark = commitMark;
+    parentTree = std::move(tree);
+  }
+
+  out << "done\n";
+  out.flush();
+
+  return out.good() ? 0 : -1;
+}
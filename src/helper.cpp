@@ -1,38 +1,137 @@
 #include "helper.h"
+#include "credentials.h"
+#include "progress.h"
+#include "checkpoint.h"
+#include "metrics.h"
 #include <vector>
 #include <set>
 #include <algorithm>
 #include <fstream>
 #include <iterator>
-#include <list>
 #include <utility>
-#include <termios.h>
-#include <unistd.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 
+// The meter is finished on every way out of the operation, so a line it
+// drew is always ended before the next message
 struct ProgressData {
-  ::git_indexer_progress fetch_progress;
-  size_t completed_steps;
-  size_t total_steps;
-  const char *path;
+  ProgressMeter progress;
+  CredentialRequest credentials;
+  size_t transferredBytes;
+  explicit ProgressData(const std::string& name) : progress(name),
+                                                   transferredBytes(0) { }
+  ~ProgressData() { progress.finish(); }
 };
 
-const static int MAX_RETRIES        { 5 };
 const static char* USER_ENV         { "USER" };
-const static std::string HTTP_REGEX { "(https)://(.*)/(.*)/(.*)\\.git" };
-const static std::string GIT_REGEX  { "(git)@(.*):(.*)/(.*)\\.git" };
+const char* FILE_PROTOCOL           { "file" };
 
-static void
-setStdinEcho(bool enable = true) {
-  struct termios tty;
-  tcgetattr(STDIN_FILENO, &tty);
+// The index and object writes of the story repository, counted
+static int
+writeIndex(::git_index* index) {
+  Metrics::add(INDEX_WRITES);
+  return ::git_index_write(index);
+}
 
-  if (!enable)
-    tty.c_lflag &= ~ECHO;
-  else
-    tty.c_lflag |= ECHO;
+// The trees of tree that base does not have at the same path, which are
+// the ones writing the index stored, short of a tree that went back to an
+// older state. Subtrees both have are not walked.
+static size_t
+countNewTrees(::git_repository* repo,
+              const ::git_tree* tree,
+              const ::git_tree* base) {
+  if (base and ::git_oid_equal(::git_tree_id(tree), ::git_tree_id(base)))
+    return 0;
+
+  size_t count = 1;
+
+  for (size_t i = 0; i < ::git_tree_entrycount(tree); i++) {
+    const ::git_tree_entry* entry = ::git_tree_entry_byindex(tree, i);
+    if (::git_tree_entry_type(entry) != GIT_OBJECT_TREE)
+      continue;
+
+    const ::git_tree_entry* old = base ?
+      ::git_tree_entry_byname(base, ::git_tree_entry_name(entry)) : nullptr;
+    if (old and ::git_oid_equal(::git_tree_entry_id(old),
+                                ::git_tree_entry_id(entry)))
+      continue;
+
+    TreePtr subtree;
+    TreePtr oldSubtree;
+
+    if (::git_tree_lookup(outPtr(subtree),
+                          repo,
+                          ::git_tree_entry_id(entry)) < 0) {
+      ::git_error_clear();
+      continue;
+    }
+
+    if (old and ::git_tree_entry_type(old) == GIT_OBJECT_TREE and
+        ::git_tree_lookup(outPtr(oldSubtree),
+                          repo,
+                          ::git_tree_entry_id(old)) < 0)
+      ::git_error_clear();
+
+    count += countNewTrees(repo, subtree.get(), oldSubtree.get());
+  }
+
+  return count;
+}
+
+// Only the trees that changed since HEAD are counted, as git_odb_write
+// skips the others
+static int
+writeIndexTree(::git_oid* treeId, ::git_index* index) {
+  ::git_repository* repo = ::git_index_owner(index);
+  ObjectPtr head;
+  TreePtr tree;
+  int error;
+
+  if ((error = ::git_index_write_tree(treeId, index)) < 0)
+    return error;
+
+  // Before the first commit every tree is new
+  if (::git_revparse_single(outPtr(head), repo, "HEAD^{tree}") < 0)
+    ::git_error_clear();
+
+  if (::git_tree_lookup(outPtr(tree), repo, treeId) < 0) {
+    ::git_error_clear();
+    return 0;
+  }
 
-  (void) tcsetattr(STDIN_FILENO, TCSANOW, &tty);
+  Metrics::add(TREES_WRITTEN,
+               countNewTrees(repo,
+                             tree.get(),
+                             reinterpret_cast<::git_tree*>(head.get())));
+  return 0;
+}
+
+// The blob is counted when the object database does not have it yet;
+// the file is hashed once more for that, which only the page files are
+static int
+addIndexPath(::git_index* index, const char* path) {
+  ::git_repository* repo = ::git_index_owner(index);
+  ::git_oid id;
+  OdbPtr odb;
+  bool known = false;
+  int error;
+
+  if (::git_repository_hashfile(&id,
+                                repo,
+                                path,
+                                GIT_OBJECT_BLOB,
+                                nullptr) == 0 and
+      ::git_repository_odb(outPtr(odb), repo) == 0)
+    known = ::git_odb_exists(odb.get(), &id);
+  ::git_error_clear();
+
+  if ((error = ::git_index_add_bypath(index, path)) < 0)
+    return error;
+
+  if (!known)
+    Metrics::add(BLOBS_WRITTEN);
+  return 0;
 }
 
 std::string
@@ -62,18 +161,16 @@ addBuffer2GitRepo(::git_repository* repo,
                            std::ios::trunc);
 
   if (!outputFile) {
-    std::cerr << "Could not open: "
-              << filename
-              << std::endl;
+    LogLine(LOG_ERROR, "Could not open").field("file", filename);
     ::exit(EXIT_FAILURE);
   }
 
   outputFile << pBuffer->str() << std::endl;
   outputFile.close();
 
-  ::git_index *index;
+  IndexPtr index;
 
-  m_giterror(::git_repository_index(&index,
+  m_giterror(::git_repository_index(outPtr(index),
                                     repo),
              "Could not open repository index",
              options);
@@ -82,25 +179,24 @@ addBuffer2GitRepo(::git_repository* repo,
   error_msg += filename;
   error_msg += " cannot be added";
 
-  m_giterror(::git_index_add_bypath(index,
-                                    filename),
+  m_giterror(addIndexPath(index.get(),
+                          filename),
              error_msg.c_str(),
              options);
 
-  m_giterror(::git_index_write(index),
+  m_giterror(writeIndex(index.get()),
              "Index cannot be written",
              options);
 
-  ::git_index_free(index);
 }
 
 void
 addFile2GitRepo(::git_repository* repo,
                 const char* filename,
                 Options& options) {
-  ::git_index *index;
+  IndexPtr index;
 
-  m_giterror(::git_repository_index(&index,
+  m_giterror(::git_repository_index(outPtr(index),
                                     repo),
              "Could not open repository index",
              options);
@@ -109,25 +205,77 @@ addFile2GitRepo(::git_repository* repo,
   error_msg += filename;
   error_msg += " cannot be remove";
 
-  m_giterror(::git_index_add_bypath(index,
-                                    filename),
+  m_giterror(addIndexPath(index.get(),
+                          filename),
              error_msg.c_str(),
              options);
 
-  m_giterror(::git_index_write(index),
+  m_giterror(writeIndex(index.get()),
              "Index cannot be written",
              options);
 
-  ::git_index_free(index);
+}
+
+// Stages a regular file whose blob the object database already has, most
+// often in a source repository alternate, by id: the file is hashed but
+// the blob is not written again. Returns false when it must be added;
+// missing tells whether the add writes a new blob then.
+static bool
+stageKnownBlob(::git_repository* repo,
+               ::git_index* index,
+               const fs::path& path,
+               bool& missing) {
+  struct stat st;
+  if (::lstat(path.c_str(), &st) != 0 or !S_ISREG(st.st_mode))
+    return false;
+
+  ::git_oid id;
+  if (::git_repository_hashfile(&id,
+                                repo,
+                                path.c_str(),
+                                GIT_OBJECT_BLOB,
+                                nullptr) < 0) {
+    ::git_error_clear();
+    return false;
+  }
+
+  OdbPtr odb;
+  if (::git_repository_odb(outPtr(odb), repo) < 0) {
+    ::git_error_clear();
+    return false;
+  }
+
+  if (!::git_odb_exists(odb.get(), &id)) {
+    missing = true;
+    return false;
+  }
+
+  ::git_index_entry entry;
+  ::memset(&entry, 0, sizeof entry);
+  entry.ctime.seconds = st.st_ctim.tv_sec;
+  entry.ctime.nanoseconds = st.st_ctim.tv_nsec;
+  entry.mtime.seconds = st.st_mtim.tv_sec;
+  entry.mtime.nanoseconds = st.st_mtim.tv_nsec;
+  entry.dev = st.st_dev;
+  entry.ino = st.st_ino;
+  entry.mode = st.st_mode & S_IXUSR ?
+    GIT_FILEMODE_BLOB_EXECUTABLE : GIT_FILEMODE_BLOB;
+  entry.uid = st.st_uid;
+  entry.gid = st.st_gid;
+  entry.file_size = static_cast<uint32_t>(st.st_size);
+  entry.id = id;
+  entry.path = path.c_str();
+
+  return ::git_index_add(index, &entry) == 0;
 }
 
 void
 addPath2GitRepo(::git_repository* repo,
                 const fs::path& path,
                 Options& options) {
-  ::git_index *index;
+  IndexPtr index;
 
-  m_giterror(::git_repository_index(&index,
+  m_giterror(::git_repository_index(outPtr(index),
                                     repo),
              "Could not open repository index",
              options);
@@ -136,25 +284,30 @@ addPath2GitRepo(::git_repository* repo,
   error_msg += path;
   error_msg += " cannot be remove";
 
-  m_giterror(::git_index_add_bypath(index,
-                                    path.c_str()),
-             error_msg.c_str(),
-             options);
+  // The file was just hashed, it is not hashed again to count its blob
+  bool missing = false;
+  if (!stageKnownBlob(repo, index.get(), path, missing)) {
+    m_giterror(::git_index_add_bypath(index.get(),
+                                      path.c_str()),
+               error_msg.c_str(),
+               options);
+    if (missing)
+      Metrics::add(BLOBS_WRITTEN);
+  }
 
-  m_giterror(::git_index_write(index),
+  m_giterror(writeIndex(index.get()),
              "Index cannot be written",
              options);
 
-  ::git_index_free(index);
 }
 
 void
 removeFile2GitRepo(::git_repository* repo,
                    const char* filename,
                    Options& options) {
-  ::git_index *index;
+  IndexPtr index;
 
-  m_giterror(::git_repository_index(&index,
+  m_giterror(::git_repository_index(outPtr(index),
                                     repo),
              "Could not open repository index",
              options);
@@ -163,25 +316,24 @@ removeFile2GitRepo(::git_repository* repo,
   error_msg += filename;
   error_msg += " cannot be remove";
 
-  m_giterror(::git_index_remove_bypath(index,
+  m_giterror(::git_index_remove_bypath(index.get(),
                                        filename),
              error_msg.c_str(),
              options);
 
-  m_giterror(::git_index_write(index),
+  m_giterror(writeIndex(index.get()),
              "Index cannot be written",
              options);
 
-  ::git_index_free(index);
 }
 
 void
 removePath2GitRepo(::git_repository* repo,
                    const fs::path& path ,
                    Options& options) {
-  ::git_index *index;
+  IndexPtr index;
 
-  m_giterror(::git_repository_index(&index,
+  m_giterror(::git_repository_index(outPtr(index),
                                     repo),
              "Could not open repository index",
              options);
@@ -190,44 +342,160 @@ removePath2GitRepo(::git_repository* repo,
   error_msg += path;
   error_msg += " cannot be remove";
 
-  m_giterror(::git_index_remove_bypath(index,
+  m_giterror(::git_index_remove_bypath(index.get(),
                                        path.c_str()),
              error_msg.c_str(),
              options);
 
-  m_giterror(::git_index_write(index),
+  m_giterror(writeIndex(index.get()),
              "Index cannot be written",
              options);
 
-  ::git_index_free(index);
 }
 
 void
 removeDir2GitRepo(::git_repository* repo,
                   const char* dirName,
+                  ChangeList& removed,
                   Options& options) {
-  ::git_index *index;
+  IndexPtr index;
 
-  m_giterror(::git_repository_index(&index,
+  m_giterror(::git_repository_index(outPtr(index),
                                     repo),
              "Could not open repository index",
              options);
 
+  std::string prefix { std::string(dirName) + "/" };
+  for (size_t i = 0; i < ::git_index_entrycount(index.get()); i++) {
+    const char* path { ::git_index_get_byindex(index.get(), i)->path };
+    if (::strncmp(path, prefix.c_str(), prefix.size()) == 0)
+      removed.emplace_back(path, FILE_DELETED);
+  }
+
   std::string error_msg { "File: " };
   error_msg += dirName;
   error_msg += " cannot be remove";
 
-  m_giterror(::git_index_remove_directory(index,
+  m_giterror(::git_index_remove_directory(index.get(),
                                           dirName,
                                           GIT_INDEX_STAGE_ANY),
              error_msg.c_str(),
              options);
 
-  m_giterror(::git_index_write(index),
+  m_giterror(writeIndex(index.get()),
              "Index cannot be written",
              options);
 
-  ::git_index_free(index);
+}
+
+void
+addObjectAlternate(::git_repository* repo,
+                   ::git_repository* source,
+                   Options& options) {
+  // Worktrees share the objects of the repository they belong to
+  fs::path objectsDir { fs::path(::git_repository_commondir(source)) /
+                        "objects" };
+  OdbPtr odb;
+
+  m_giterror(::git_repository_odb(outPtr(odb), repo),
+             "Cannot open object database",
+             options);
+
+  // Directories that are already alternates are skipped by libgit2
+  m_giterror(::git_odb_add_disk_alternate(odb.get(), objectsDir.c_str()),
+             "Cannot add source objects as alternate",
+             options);
+}
+
+void
+packReachableObjects(::git_repository* repo,
+                     const char* refName,
+                     Options& options) {
+  ::git_oid tip;
+
+  if (::git_reference_name_to_id(&tip, repo, refName) < 0) {
+    ::git_error_clear();
+    return;
+  }
+
+  RevwalkPtr walk;
+  m_giterror(::git_revwalk_new(outPtr(walk), repo),
+             "Cannot create revision walk",
+             options);
+  m_giterror(::git_revwalk_push(walk.get(), &tip),
+             "Cannot walk the story branch",
+             options);
+
+  PackbuilderPtr packbuilder;
+  m_giterror(::git_packbuilder_new(outPtr(packbuilder), repo),
+             "Cannot create pack builder",
+             options);
+  ::git_packbuilder_set_threads(packbuilder.get(), 0);
+  m_giterror(::git_packbuilder_insert_walk(packbuilder.get(), walk.get()),
+             "Cannot collect the story objects",
+             options);
+
+  fs::path packDir { fs::path(::git_repository_path(repo)) /
+                     "objects" / "pack" };
+  m_giterror(::git_packbuilder_write(packbuilder.get(),
+                                     packDir.c_str(),
+                                     0,
+                                     nullptr,
+                                     nullptr),
+             "Cannot write the story pack",
+             options);
+}
+
+int
+writeCommitGraph(::git_repository* repo,
+                 const char* refName) {
+  ::git_oid tip;
+  int error;
+
+  if (::git_reference_name_to_id(&tip, repo, refName) < 0) {
+    ::git_error_clear();
+    return 0;
+  }
+
+  RevwalkPtr walk;
+  CommitGraphWriterPtr writer;
+  ::git_commit_graph_writer_options opts = GIT_COMMIT_GRAPH_WRITER_OPTIONS_INIT;
+  fs::path infoDir { fs::path(::git_repository_path(repo)) /
+                     "objects" / "info" };
+  fs::create_directories(infoDir);
+
+  // Each owner only takes its handle at the end of its own statement
+  if ((error = ::git_revwalk_new(outPtr(walk), repo)) < 0)
+    return error;
+  if ((error = ::git_revwalk_push(walk.get(), &tip)) < 0)
+    return error;
+  if ((error = ::git_commit_graph_writer_new(outPtr(writer),
+                                             infoDir.c_str())) < 0)
+    return error;
+  if ((error = ::git_commit_graph_writer_add_revwalk(writer.get(),
+                                                     walk.get())) < 0)
+    return error;
+
+  return ::git_commit_graph_writer_commit(writer.get(), &opts);
+}
+
+int
+writeMultiPackIndex(::git_repository* repo) {
+  fs::path packDir { fs::path(::git_repository_path(repo)) /
+                     "objects" / "pack" };
+  MidxWriterPtr writer;
+  int error;
+
+  if ((error = ::git_midx_writer_new(outPtr(writer), packDir.c_str())) < 0)
+    return error;
+
+  for (const auto& entry : fs::directory_iterator(packDir))
+    if (entry.path().extension() == ".idx" and
+        (error = ::git_midx_writer_add(writer.get(),
+                                       entry.path().c_str())) < 0)
+      return error;
+
+  return ::git_midx_writer_commit(writer.get());
 }
 
 void moveFile2GitRepo(::git_repository *repo,
@@ -236,72 +504,110 @@ void moveFile2GitRepo(::git_repository *repo,
                       Options& options) {
 }
 
+GitFailure::GitFailure(int error, const std::string& message) :
+  error(error),
+  klass(0),
+  reason("no detailed info"),
+  message(message) {
+  const ::git_error *g_error = ::git_error_last();
+
+  if (g_error) {
+    klass = g_error->klass;
+    reason = g_error->message;
+  }
+}
+
 void m_giterror(int error,
                 const char *msg,
                 Options options) {
 
-  if (error < GIT_OK) {
-    const ::git_error *g_error = ::git_error_last();
+  if (error < GIT_OK)
+    m_giterror(GitFailure(error, msg), options);
+}
 
-    std::cerr << msg
-              << " due ("
-              << error
-              << ") "
-              << g_error->klass
-              << " "
-              << g_error->message
-              << std::endl;
+void m_giterror(const GitFailure& failure,
+                Options options) {
 
-    if (!options.debug)
+  if (failure.error < GIT_OK) {
+    LogLine(LOG_ERROR, failure.message)
+      .field("error", failure.error)
+      .field("class", failure.klass)
+      .field("reason", failure.reason);
+
+    // The pages committed so far are kept for --resume
+    if (hasCheckpoint(options.targetPath))
+      LogLine(LOG_ERROR, "Run again with --resume to continue after the last"
+              " committed page");
+    else if (!options.debug)
       fs::remove_all(options.targetPath);
 
     ::exit(EXIT_FAILURE);
   }
 }
 
-void
-commitGitRepo(::git_repository* repo,
-              std::string& message,
-              Options& options) {
-  ::git_config *config_default;
+// In deterministic mode every page is stamped at epoch + page number, so
+// rebuilding an unchanged story gives the same commit ids
+static SignaturePtr
+createSignature(int pageNumber,
+                Options& options) {
+  ConfigPtr config_default;
 
-  m_giterror(::git_config_open_default(&config_default),
+  m_giterror(::git_config_open_default(outPtr(config_default)),
              "Cannot open default configuration",
              options);
 
-  ::git_config_entry *entry;
-  m_giterror(::git_config_get_entry(&entry,
-                                    config_default,
+  ConfigEntryPtr entry;
+  m_giterror(::git_config_get_entry(outPtr(entry),
+                                    config_default.get(),
                                     "user.name"),
              "Cannot find user name at default config",
              options);
   std::string userName { entry->value };
-  ::git_config_entry_free(entry);
 
-  m_giterror(::git_config_get_entry(&entry,
-                                    config_default,"user.email"),
+  m_giterror(::git_config_get_entry(outPtr(entry),
+                                    config_default.get(),"user.email"),
              "Cannot find user email at default config",
              options);
   std::string userEmail { entry->value };
-  ::git_config_entry_free(entry);
 
-  ::git_signature *signature = nullptr;
+  SignaturePtr signature;
 
-  m_giterror(::git_signature_now(&signature,
-                                 userName.c_str(),
-                                 userEmail.c_str()),
-             "Cannot create user signature",
-             options);
+  if (options.deterministic) {
+    m_giterror(::git_signature_new(outPtr(signature),
+                                   userName.c_str(),
+                                   userEmail.c_str(),
+                                   options.epoch + pageNumber,
+                                   0),
+               "Cannot create user signature",
+               options);
+  }
+  else {
+    m_giterror(::git_signature_now(outPtr(signature),
+                                   userName.c_str(),
+                                   userEmail.c_str()),
+               "Cannot create user signature",
+               options);
+  }
+
+  return signature;
+}
 
-  ::git_index *index;
-  ::git_tree* tree = nullptr;
+void
+commitGitRepo(::git_repository* repo,
+              std::string& message,
+              Options& options,
+              int pageNumber) {
+  SignaturePtr signature = createSignature(pageNumber, options);
+
+  IndexPtr index;
+  TreePtr tree;
   ::git_oid tree_oid;
-  ::git_reference* ref = nullptr;
-  ::git_object* parent = nullptr;
+  ReferencePtr ref;
+  ObjectPtr parent;
 
   int error;
-  if ((error = ::git_revparse_ext(&parent,
-                                  &ref,
+  if ((error = ::git_revparse_ext(outPtr(parent),
+                                  outPtr(ref),
                                   repo,
                                   "HEAD")) != GIT_ENOTFOUND) {
 
@@ -310,21 +616,21 @@ commitGitRepo(::git_repository* repo,
                options);
   }
 
-  m_giterror(::git_repository_index(&index,
+  m_giterror(::git_repository_index(outPtr(index),
                                     repo),
              "Could not open repository index",
              options);
 
-  m_giterror(::git_index_write_tree(&tree_oid,
-                                    index),
+  m_giterror(writeIndexTree(&tree_oid,
+                            index.get()),
              "Could not write tree",
              options);
 
-  m_giterror(::git_index_write(index),
+  m_giterror(writeIndex(index.get()),
              "Could not write index",
              options);
 
-  ::git_tree_lookup(&tree,
+  ::git_tree_lookup(outPtr(tree),
                     repo,
                     &tree_oid);
 
@@ -333,97 +639,41 @@ commitGitRepo(::git_repository* repo,
   m_giterror(::git_commit_create_v(&new_commit_id,
                                    repo,
                                    "HEAD",
-                                   signature,
-                                   signature,
+                                   signature.get(),
+                                   signature.get(),
                                    "UTF-8",
                                    message.c_str(),
-                                   tree,
+                                   tree.get(),
                                    parent ? 1 : 0,
-                                   parent),
+                                   parent.get()),
              "Error creating commit",
              options);
-
-  ::git_index_free(index);
-  ::git_tree_free(tree);
-  ::git_object_free(parent);
-  ::git_reference_free(ref);
-}
-
-static void
-printProgress(const ProgressData *pd)
-{
-  int network_percent = pd->fetch_progress.total_objects > 0 ?
-    (100*pd->fetch_progress.received_objects) / pd->fetch_progress.total_objects :
-    0;
-  int index_percent = pd->fetch_progress.total_objects > 0 ?
-    (100*pd->fetch_progress.indexed_objects) / pd->fetch_progress.total_objects :
-    0;
-
-  int checkout_percent = pd->total_steps > 0
-    ? (int)((100 * pd->completed_steps) / pd->total_steps)
-    : 0;
-  size_t kbytes = pd->fetch_progress.received_bytes / 1024;
-
-  if (pd->fetch_progress.total_objects &&
-      pd->fetch_progress.received_objects == pd->fetch_progress.total_objects) {
-    std::cout << "Resolving deltas " // Format: %u/%u\r",
-              <<  static_cast<unsigned int>(pd->fetch_progress.indexed_deltas)
-              << '/'
-              <<  static_cast<unsigned int>(pd->fetch_progress.total_deltas)
-              << std::endl;
-  } else {
-    // TODO Rewrite this output
-    // printf("net %3d%% (%4" PRIuZ " kb, %5u/%5u)  /  idx %3d%% (%5u/%5u)  /  chk %3d%% (%4" PRIuZ "/%4" PRIuZ")%s\n",
-    //        network_percent, kbytes,
-    //        pd->fetch_progress.received_objects, pd->fetch_progress.total_objects,
-    //        index_percent, pd->fetch_progress.indexed_objects, pd->fetch_progress.total_objects,
-    //        checkout_percent,
-    //        pd->completed_steps, pd->total_steps,
-    //        pd->path);
-    std::cout << "net ";
-    std::cout.width(3);
-    std::cout << network_percent
-              << " % ("
-              << kbytes
-              << " "
-              << pd->fetch_progress.received_objects
-              << " "
-              << pd->fetch_progress.total_objects
-              << " "
-              << index_percent
-              << " kb, (";
-    std::cout.width(5);
-    std::cout << static_cast<unsigned int>(pd->fetch_progress.indexed_objects)
-              << "/";
-    std::cout.width(5);
-    std::cout << static_cast<unsigned int>(pd->fetch_progress.total_objects)
-              << ")  /  chk ";
-    std::cout.width(3);
-    std::cout << checkout_percent
-              << " "
-              << pd->completed_steps
-              << " "
-              << pd->total_steps
-              << " "
-              << pd->path
-              << std::endl;
-  }
+  Metrics::add(COMMITS_CREATED);
 }
 
 static int
 sidebandProgress(const char *str, int len, void *payload) {
-  (void)payload; /* unused */
-
-  std::cout << "remote: " << len << " " << str << std::endl;;
-  std::cout.flush();
+  ProgressData *pd = static_cast<ProgressData*>(payload);
+  pd->progress.sideband(str, len);
   return 0;
 }
 
 static int fetchProgress(const ::git_indexer_progress *stats,
                          void *payload) {
   ProgressData *pd = static_cast<ProgressData*>(payload);
-  pd->fetch_progress = *stats;
-  printProgress(pd);
+  pd->progress.transfer(stats);
+  pd->transferredBytes = stats->received_bytes;
+  return 0;
+}
+
+static int
+pushProgress(unsigned int current,
+             unsigned int total,
+             size_t bytes,
+             void* payload) {
+  ProgressData *pd = static_cast<ProgressData*>(payload);
+  pd->progress.push(current, total, bytes);
+  pd->transferredBytes = bytes;
   return 0;
 }
 
@@ -433,10 +683,7 @@ checkoutProgress(const char* path,
                  size_t tot,
                  void* payload) {
   ProgressData *pd = static_cast<ProgressData*>(payload);
-  pd->completed_steps = cur;
-  pd->total_steps = tot;
-  pd->path = path;
-  printProgress(pd);
+  pd->progress.checkout(cur, tot);
 }
 
 static int
@@ -449,24 +696,6 @@ credPassThrough(::git_credential **out,
 }
 
 static std::string userNameFromURL(std::string& url);
-static std::list<std::pair<fs::path,fs::path>>& getListSSHKeys() {
- fs::path sshDir { ::getenv("HOME") };
- sshDir /= ".ssh";
-
- std::list<std::pair<fs::path,fs::path>> *keys =
-   new std::list<std::pair<fs::path,fs::path>>();
-
-  for (auto const& dir_entry : fs::directory_iterator { sshDir }) {
-    if (dir_entry.path().extension() == ".pub") {
-      fs::path privKey { dir_entry.path() };
-      privKey.replace_extension("");
-      std::pair<fs::path, fs::path> p { privKey, dir_entry.path() };
-      keys->push_back(p);
-    }
-  }
-
-  return *keys;
-}
 
 static int
 credAcquireCb(::git_credential **out,
@@ -474,137 +703,63 @@ credAcquireCb(::git_credential **out,
               const char *userNameURL,
               unsigned int allowed_types,
               void *payload) {
+  ProgressData *pd = static_cast<ProgressData*>(payload);
   std::string sURL { url };
-  std::string sUserName { userNameURL ? userNameURL : "" };
-  std::string userName { userNameURL ? sUserName : userNameFromURL(sURL) } ;
-  std::string passWord { "" };
-  unsigned int credentialTypes[] = { GIT_CREDENTIAL_SSH_KEY,
-                                     GIT_CREDENTIAL_USERPASS_PLAINTEXT,
-                                     GIT_CREDENTIAL_USERNAME };
-  int nextTypeToTry = -1;
-
-  nextTypeToTry++;
-  std::cout << "Trying to get a credential"
-            << " nextTypetoTry: " << nextTypeToTry
-            << " sizeof(credentialTypes) "
-            << (sizeof(credentialTypes) / sizeof(unsigned int))
-            << " currentType: " << credentialTypes[nextTypeToTry]
-            << " userName: " << userName
-            << " allowedTypes: " << allowed_types
-            << std::endl;
-
-  int status = GIT_ERROR;
-  // if (nextTypeToTry < sizeof(credentialTypes) / sizeof(int)) {
-  while (nextTypeToTry < sizeof(credentialTypes) / sizeof(int)) {
-    switch (credentialTypes[nextTypeToTry]) {
-    case GIT_CREDENTIAL_SSH_KEY:
-      if (allowed_types & credentialTypes[nextTypeToTry]) {
-
-        std::list<std::pair<fs::path,fs::path>> keys = getListSSHKeys();
-
-        for (auto p : keys) {
-          std::cout << "Url: " << url << std::endl
-                    << "Username: " << userName << std::endl
-                    << "Private Key: " << p.first << std::endl
-                    << "Public Key: " << p.second << std::endl;
-
-          std::cout << "Enter password for : " << p.first.filename();
-          std::cout.flush();
-          setStdinEcho(false);
-          std::cin >> passWord;
-          setStdinEcho(true);
-          status = ::git_credential_ssh_key_new(out,
-                                                userName.c_str(),
-                                                p.first.c_str(),
-                                                p.second.c_str(),
-                                                passWord.c_str());
-          if (status == GIT_OK) return status;
-          passWord.clear();
-        }
-      }
-      break;
-    case GIT_CREDENTIAL_USERPASS_PLAINTEXT:
-      if (allowed_types & credentialTypes[nextTypeToTry])
-        for (int retries = 0; retries < MAX_RETRIES; retries++) {
-
-          std::cout << "Enter user (" <<  userName
-                    << ") password at repository: ";
-          std::cout.flush();
-          setStdinEcho(false);
-          std::cin >> passWord;
-          setStdinEcho(true);
-          status = ::git_credential_userpass_plaintext_new(out,
-                                                           userName.c_str(),
-                                                           passWord.c_str());
-          if (status == GIT_OK) return status;
-        }
-      break;
-    case GIT_CREDENTIAL_USERNAME:
-      if (allowed_types & GIT_CREDENTIAL_USERNAME) {
-        std::cout << "Credential USERNAME: " << userName
-                  << std::endl;
-        status = ::git_credential_username_new(out,
-                                               userName.c_str());
-        if (status == GIT_OK) return status;
-      }
-      break;
-    default:
-      status = GIT_ERROR;
-      break;
-    }
-    if (status == GIT_OK) break;
-    nextTypeToTry++;
-  }
-
-  // else {
-  //   status = GIT_ERROR;
-  // }
+  std::string userName { userNameURL ? userNameURL : userNameFromURL(sURL) };
 
-  std::cout << "Status: " << status << std::endl;
-
-  return status;
+  return CredentialProvider::instance().acquire(out,
+                                                sURL,
+                                                userName,
+                                                allowed_types,
+                                                pd->credentials);
 }
 
 int
 cloneGitRepo(fs::path& location,
              std::string& url,
              RepoDesc* rd,
-             Options& options) {
+             Options& options,
+             bool checkout) {
 
-  ProgressData pd = { {0} };
+  ProgressData pd(rd ? rd->repoName : url);
   ::git_clone_options cloneOpts = GIT_CLONE_OPTIONS_INIT;
   ::git_checkout_options checkoutOpts = GIT_CHECKOUT_OPTIONS_INIT;
   int error;
 
-  checkoutOpts.checkout_strategy = GIT_CHECKOUT_SAFE;
-  // checkoutOpts.progress_cb = checkoutProgress;
+  checkoutOpts.checkout_strategy = checkout ? GIT_CHECKOUT_SAFE :
+    GIT_CHECKOUT_NONE;
+  checkoutOpts.progress_cb = checkoutProgress;
   checkoutOpts.progress_payload = &pd;
   cloneOpts.checkout_opts = checkoutOpts;
-  // cloneOpts.fetch_opts.callbacks.sideband_progress = sidebandProgress;
-  // cloneOpts.fetch_opts.callbacks.transfer_progress = fetchProgress;
+  cloneOpts.fetch_opts.callbacks.sideband_progress = sidebandProgress;
+  cloneOpts.fetch_opts.callbacks.transfer_progress = fetchProgress;
   cloneOpts.fetch_opts.callbacks.credentials = credAcquireCb;
   cloneOpts.fetch_opts.callbacks.payload = &pd;
 
-  std::cout << "Cloning: " << url << " at " << location << std::endl;
-  error = ::git_clone(&rd->repo, url.c_str(), location.c_str(), &cloneOpts); // nullptr);
+  // Local sources bypass the transport and hardlink their objects
+  if (rd and rd->protocol == FILE_PROTOCOL)
+    cloneOpts.local = GIT_CLONE_LOCAL;
+
+  LogLine(LOG_INFO, "Cloning").field("url", url).field("location", location);
+  error = ::git_clone(outPtr(rd->repo), url.c_str(), location.c_str(), &cloneOpts); // nullptr);
   // &cloneOpts);
-  std::cout << std::endl;
+  pd.progress.finish();
+  Metrics::add(CLONE_BYTES, pd.transferredBytes);
+
+  if (error == 0)
+    CredentialProvider::instance().confirm(url, pd.credentials);
 
   if (error != 0) {
     const git_error *err = ::git_error_last();
-    if (err) {
-      std::cerr << "ERROR "
-                << err->klass
-                << ":"
-                << err->message
-                << std::endl;
-    }
-    else {
-      std::cerr << "ERROR "
-                << error
-                << " no detailed info"
-                << std::endl;
-    }
+    if (err)
+      LogLine(LOG_ERROR, "Clone failed")
+        .field("url", url)
+        .field("class", err->klass)
+        .field("reason", err->message);
+    else
+      LogLine(LOG_ERROR, "Clone failed")
+        .field("url", url)
+        .field("error", error);
   }
   // else if (clonedRepo) {
   //   // ::git_repository_free(clonedRepo);
@@ -614,33 +769,64 @@ cloneGitRepo(fs::path& location,
 }
 
 static
-char* getRefSpec(const char* refSpec, bool force) {
-  size_t size = ::strlen(refSpec);
-  size_t realSize = size * (!force ? 1 : 2) + 1 + (!force ? 0 : 2);
-  char* ref_spec = new char[realSize];
-  ::bzero(ref_spec, realSize);
-  if (force) ::strcpy(ref_spec, "+");
-  else ::strcpy(ref_spec, "");
-  ::strcat(ref_spec, refSpec);
-  if (force) ::strcat(::strcat(ref_spec, ":"), refSpec);
+std::string getRefSpec(const char* refSpec, bool force) {
+  std::string ref_spec { force ? "+" : "" };
+  ref_spec += refSpec;
+  if (force) ref_spec += std::string(":") + refSpec;
   return ref_spec;
 }
 
+// Lists the remote advertised refs and compares refSpec with the local tip,
+// a republished unchanged story (see --deterministic) needs no transfer
+static bool
+remoteHasTip(::git_repository* repo,
+             ::git_remote* remote,
+             const char* refSpec,
+             const ::git_remote_callbacks& callbacks) {
+  ::git_oid localTip;
+  if (::git_reference_name_to_id(&localTip, repo, refSpec) < 0)
+    return false;
+
+  if (::git_remote_connect(remote,
+                           GIT_DIRECTION_PUSH,
+                           &callbacks,
+                           nullptr,
+                           nullptr) < 0) {
+    ::git_error_clear();
+    return false;
+  }
+
+  const ::git_remote_head **heads = nullptr;
+  size_t nHeads = 0;
+  if (::git_remote_ls(&heads, &nHeads, remote) < 0) {
+    ::git_error_clear();
+    return false;
+  }
+
+  for (size_t i = 0; i < nHeads; ++i) {
+    if (::strcmp(heads[i]->name, refSpec) == 0)
+      return ::git_oid_equal(&heads[i]->oid, &localTip);
+  }
+
+  return false;
+}
+
 int
 pushGitRepo(::git_repository* repo,
             Options& options,
             const char* refSpec,
             bool force) {
 
-  ProgressData pd = { {0} };
-  ::git_remote* remote = nullptr;
-  char* ref_spec = getRefSpec(refSpec, force);
+  ProgressData pd("origin");
+  RemotePtr remote;
+  std::string ref_spec { getRefSpec(refSpec, force) };
+  char* ref_specs[] = { const_cast<char*>(ref_spec.c_str()) };
   const git_strarray refspecs = {
-    &ref_spec,
+    ref_specs,
     1
   };
 
-  m_giterror(::git_remote_lookup(&remote, repo, "origin"),
+  m_giterror(::git_remote_lookup(outPtr(remote), repo, "origin"),
              "Unable to lookup remote", options);
 
 
@@ -650,276 +836,345 @@ pushGitRepo(::git_repository* repo,
              "Error initializing push", options);
 
   d_git_push_options.callbacks.sideband_progress = sidebandProgress;
-  d_git_push_options.callbacks.transfer_progress = fetchProgress;
+  d_git_push_options.callbacks.push_transfer_progress = pushProgress;
   d_git_push_options.callbacks.credentials = credAcquireCb;
   d_git_push_options.callbacks.payload = &pd;
 
-  return ::git_remote_push(remote,
-                           &refspecs,
-                           &d_git_push_options);
-}
+  // The connection is kept open for the push itself
+  if (remoteHasTip(repo,
+                   remote.get(),
+                   refSpec,
+                   d_git_push_options.callbacks)) {
+    pd.progress.finish();
+    LogLine(LOG_INFO, "Nothing to push")
+      .field("remote", ::git_remote_url(remote.get()))
+      .field("ref", refSpec);
+    CredentialProvider::instance().confirm(::git_remote_url(remote.get()),
+                                           pd.credentials);
+    return 0;
+  }
 
-static std::string
-userNameFromURL(std::string& url) {
-  std::regex line_regex { HTTP_REGEX };
-  std::smatch repoInfo;
+  int error = ::git_remote_push(remote.get(),
+                               &refspecs,
+                               &d_git_push_options);
+  pd.progress.finish();
+  Metrics::add(PUSH_BYTES, pd.transferredBytes);
+
+  if (error == 0)
+    CredentialProvider::instance().confirm(::git_remote_url(remote.get()),
+                                           pd.credentials);
+
+  return error;
+}
 
-  if (std::regex_match(url, repoInfo, line_regex))
-      return repoInfo[3];
+struct URLParts {
+  std::string protocol;
+  std::string login;
+  std::string host;
+  std::string port;
+  std::string path;
+};
 
-  line_regex = GIT_REGEX;
+// Splits a repository URL by hand, it runs once per repository key and
+// callback. Accepted forms:
+//   https://host[:port]/user/repo.git (also http:// and git://)
+//   ssh://[login@]host[:port]/user/repo.git
+//   login@host:user/repo.git
+//   file:///path/repo.git, /path/repo, ./repo or ../repo
+static bool
+splitURL(const std::string& url, URLParts& parts) {
+  const std::string fileScheme { "file://" };
+  size_t scheme = url.find("://");
+
+  if (url.compare(0, fileScheme.size(), fileScheme) == 0) {
+    parts.protocol = FILE_PROTOCOL;
+    parts.path = url.substr(fileScheme.size());
+    return !parts.path.empty();
+  }
 
-  if (std::regex_match(url, repoInfo, line_regex))
-    return repoInfo[3];
+  if (scheme != std::string::npos) {
+    parts.protocol = url.substr(0, scheme);
+    size_t begin = scheme + 3;
+    size_t slash = url.find('/', begin);
+    if (slash == std::string::npos) return false;
+
+    std::string authority { url.substr(begin, slash - begin) };
+    size_t at = authority.rfind('@');
+    if (at != std::string::npos) {
+      parts.login = authority.substr(0, at);
+      authority.erase(0, at + 1);
+    }
 
-  std::string ret { ::getenv(USER_ENV) };
+    size_t colon = authority.rfind(':');
+    if (colon != std::string::npos and authority.back() != ']') {
+      parts.port = authority.substr(colon + 1);
+      authority.erase(colon);
+      if (parts.port.empty() or
+          parts.port.find_first_not_of("0123456789") != std::string::npos)
+        return false;
+    }
 
-  return ret;
-}
+    parts.host = authority;
+    parts.path = url.substr(slash + 1);
 
-RepoDesc*
-url2RepoDesc(std::string& url) {
-  RepoDesc *retValue = nullptr;
+    return (parts.protocol == "https" or parts.protocol == "http" or
+            parts.protocol == "ssh" or parts.protocol == "git") and
+      !parts.host.empty();
+  }
 
-  std::regex line_regex { HTTP_REGEX };
-  std::smatch repoInfo;
+  size_t colon = url.find(':');
+  size_t slash = url.find('/');
 
-  if (std::regex_match(url,repoInfo,line_regex)) {
-    retValue = new RepoDesc(repoInfo[1],
-                            repoInfo[2],
-                            repoInfo[3],
-                            repoInfo[4]);
+  // A colon before any slash makes it scp-like syntax, otherwise a path
+  if (colon == std::string::npos or
+      (slash != std::string::npos and slash < colon)) {
+    parts.protocol = FILE_PROTOCOL;
+    parts.path = url;
+    return !url.empty();
   }
-  else {
-    line_regex = GIT_REGEX; // "(git)@(.*):(.*)/(.*)\\.git";
-    if (std::regex_match(url, repoInfo, line_regex)) {
-      retValue = new RepoDesc(repoInfo[1],
-                              repoInfo[2],
-                              repoInfo[3],
-                              repoInfo[4]);
-    }
+
+  parts.protocol = "ssh";
+  std::string authority { url.substr(0, colon) };
+  size_t at = authority.find('@');
+  if (at != std::string::npos) {
+    parts.login = authority.substr(0, at);
+    authority.erase(0, at + 1);
   }
+  parts.host = authority;
+  parts.path = url.substr(colon + 1);
 
-  return retValue;
+  return !parts.host.empty() and !parts.path.empty();
 }
 
-static int
-getAnnotatedCommitFromName(::git_annotated_commit** commit,
-                           ::git_repository* repo,
-                           const std::string& name) {
-  ::git_reference *ref;
-  int error = ::git_reference_dwim(&ref, repo, name.c_str());
-
-  if (error == GIT_OK) {
-    ::git_annotated_commit_from_ref(commit, repo, ref);
-    ::git_reference_free(ref);
+// The last two components of the path are the user and the repository
+static void
+splitRepoPath(std::string path, std::string& user, std::string& repoName) {
+  while (!path.empty() and path.back() == '/')
+    path.pop_back();
+
+  const std::string gitSuffix { ".git" };
+  if (path.size() > gitSuffix.size() and
+      path.compare(path.size() - gitSuffix.size(),
+                   gitSuffix.size(), gitSuffix) == 0)
+    path.erase(path.size() - gitSuffix.size());
+
+  size_t slash = path.rfind('/');
+  repoName = path.substr(slash == std::string::npos ? 0 : slash + 1);
+  user.clear();
+
+  if (slash != std::string::npos) {
+    path.erase(slash);
+    size_t previous = path.rfind('/');
+    user = path.substr(previous == std::string::npos ? 0 : previous + 1);
   }
-  else {
-    // ::git_reference_free(ref);
-    ::git_object *obj;
+}
 
-    error = ::git_revparse_single(&obj, repo, name.c_str());
+static std::string
+userNameFromURL(std::string& url) {
+  URLParts parts;
 
-    if (error == GIT_OK) {
-      ::git_annotated_commit_lookup(commit, repo, ::git_object_id(obj));
-      ::git_object_free(obj);
-    }
+  if (splitURL(url, parts) and parts.protocol != FILE_PROTOCOL) {
+    std::string user, repoName;
+    splitRepoPath(parts.path, user, repoName);
+    if (!user.empty()) return user;
   }
 
-  return error;
+  const char* env = ::getenv(USER_ENV);
+
+  return env ? env : "";
 }
 
-static int
-getAnnotatedCommitFromGuessingName(::git_annotated_commit** commit,
-                                   ::git_repository* repo,
-                                   const std::string& name) {
-  ::git_strarray   remotes { nullptr, 0 };
-  ::git_reference* remote_ref  { nullptr };
-  int error;
+std::unique_ptr<RepoDesc>
+url2RepoDesc(std::string& url) {
+  URLParts parts;
 
-  if ((error = ::git_remote_list(&remotes, repo)) < GIT_OK) {
-    ::git_reference_free(remote_ref);
-    ::git_strarray_dispose(&remotes);
+  if (!splitURL(url, parts)) return nullptr;
 
-    return error;
-  }
+  std::string user, repoName;
+  splitRepoPath(parts.path, user, repoName);
 
-  size_t i;
-  for (i = 0; i < remotes.count; i++) {
-    std::stringstream refname;
+  if (repoName.empty() or repoName == "." or repoName == "..")
+    return nullptr;
 
-    refname << "ref/remotes/" << remotes.strings[i] << "/" << name;
+  std::unique_ptr<RepoDesc> retValue { new RepoDesc(parts.protocol,
+                                                   parts.host,
+                                                   user,
+                                                   repoName) };
+  retValue->port = parts.port;
+  retValue->path = parts.path;
 
-    if ((error = ::git_reference_lookup(&remote_ref,
-                                        repo,
-                                        refname.str().c_str())) < GIT_OK)
-      if (error < 0 and error != GIT_ENOTFOUND) break;
+  return retValue;
+}
 
-    break;
-  }
+// Runs on the materializer, so errors are returned for the writer to
+// report instead of ending the process from here
+int
+addWorktree(RepositoryPtr& worktreeRepo,
+            ::git_repository* repo,
+            const std::string& name,
+            const fs::path& path) {
+  ::git_worktree_add_options opts = GIT_WORKTREE_ADD_OPTIONS_INIT;
+  WorktreePtr worktree;
 
-  if (!remote_ref) {
-    error = GIT_ENOTFOUND;
-    ::git_reference_free(remote_ref);
-    ::git_strarray_dispose(&remotes);
-    return error;
-  }
+  // The first checkout of a page fills it, with its paths if any
+  opts.checkout_options.checkout_strategy = GIT_CHECKOUT_NONE;
 
-  error = ::git_annotated_commit_from_ref(commit, repo, remote_ref);
+  fs::create_directories(path.parent_path());
 
-  ::git_reference_free(remote_ref);
-  ::git_strarray_dispose(&remotes);
-  return error;
+  // A resumed build finds the worktrees of the failed one in place
+  if (::git_worktree_lookup(outPtr(worktree), repo, name.c_str()) != GIT_OK) {
+    ::git_error_clear();
+
+    int error = ::git_worktree_add(outPtr(worktree),
+                                   repo,
+                                   name.c_str(),
+                                   path.c_str(),
+                                   &opts);
+    if (error < GIT_OK) return error;
+  }
+
+  return ::git_repository_open_from_worktree(outPtr(worktreeRepo),
+                                             worktree.get());
 }
 
-static int
-performCheckoutRef(::git_repository *repo,
-                   ::git_annotated_commit *target,
-                   const std::string& target_ref) {
+int
+checkoutWorktree(::git_repository* worktree,
+                 const ::git_oid& commitId,
+                 const std::string& repoName,
+                 Options& options,
+                 const std::vector<std::string>& paths) {
+  ProgressData pd(repoName);
+  CommitPtr target_commit;
   ::git_checkout_options checkout_opts = GIT_CHECKOUT_OPTIONS_INIT;
-  ::git_reference *ref = NULL, *branch = NULL;
-  ::git_commit *target_commit = NULL;
   int error;
 
-  /** Setup our checkout options from the parsed options */
-  checkout_opts.checkout_strategy = GIT_CHECKOUT_SAFE;
-  // if (opts->force)
-  //   checkout_opts.checkout_strategy = GIT_CHECKOUT_FORCE;
+  checkout_opts.checkout_strategy = GIT_CHECKOUT_FORCE;
+  checkout_opts.progress_cb = checkoutProgress;
+  checkout_opts.progress_payload = &pd;
 
-  // if (opts->progress)
-  //   checkout_opts.progress_cb = print_checkout_progress;
+  std::vector<char*> pathspecs;
+  for (const auto& path : paths)
+    pathspecs.push_back(const_cast<char*>(path.c_str()));
+  checkout_opts.paths.strings = pathspecs.data();
+  checkout_opts.paths.count = pathspecs.size();
 
-  // if (opts->perf)
-  //   checkout_opts.perfdata_cb = print_perf_data;
+  // The owner only takes its handle at the end of the lookup statement
+  error = ::git_commit_lookup(outPtr(target_commit),
+                              worktree,
+                              &commitId);
 
-  /** Grab the commit we're interested to move to */
-  error = ::git_commit_lookup(&target_commit,
-                              repo,
-                              git_annotated_commit_id(target));
+  if (error == GIT_OK and
+      (error = ::git_checkout_tree(worktree,
+                                   (const git_object *)target_commit.get(),
+                                   &checkout_opts)) == GIT_OK)
+    // Several worktrees may hold the same ref, so HEAD is always detached
+    error = ::git_repository_set_head_detached(worktree,
+                                               &commitId);
 
-  if (error != GIT_OK) {
-    std::cerr << "Failed to lookup commit: "
-              << git_error_last()->message << std::endl;
-    ::git_commit_free(target_commit);
-    ::git_reference_free(branch);
-    ::git_reference_free(ref);
+  pd.progress.finish();
 
-    return error;
-  }
+  return error;
+}
 
-  /**
-   * Perform the checkout so the workdir corresponds to what target_commit
-   * contains.
-   *
-   * Note that it's okay to pass a git_commit here, because it will be
-   * peeled to a tree.
-   */
-  error = ::git_checkout_tree(repo,
-                              (const git_object *)target_commit,
-                              &checkout_opts);
-
-  if (error != GIT_OK) {
-    std::cerr << "failed to checkout tree: "
-              << git_error_last()->message
-              << std::endl;
-
-    ::git_commit_free(target_commit);
-    ::git_reference_free(branch);
-    ::git_reference_free(ref);
+int
+RefIndex::build(::git_repository* repo) {
+  ReferenceIteratorPtr it;
+  ReferencePtr ref;
+  int error;
 
+  this->repo = repo;
+  refs.clear();
+  remoteBranches.clear();
+
+  if ((error = ::git_reference_iterator_new(outPtr(it), repo)) < GIT_OK)
     return error;
-  }
 
-  /**
-   * Now that the checkout has completed, we have to update HEAD.
-   *
-   * Depending on the "origin" of target (ie. it's an OID or a branch name),
-   * we might need to detach HEAD.
-   */
-  if (::git_annotated_commit_ref(target)) {
-    const char *target_head;
-
-    if ((error = ::git_reference_lookup(&ref, repo, git_annotated_commit_ref(target))) < 0) {
-      if (error != 0) {
-        std::cerr << "failed to update HEAD reference: "
-                  << git_error_last()->message << std::endl;
-        ::git_commit_free(target_commit);
-        ::git_reference_free(branch);
-        ::git_reference_free(ref);
-
-        return error;
-      }
-    }
+  const std::string remotes { "refs/remotes/" };
 
-    if (::git_reference_is_remote(ref)) {
-      if ((error = ::git_branch_create_from_annotated(&branch,
-                                                      repo,
-                                                      target_ref.c_str(),
-                                                      target, 0)) < 0) {
-        std::cerr << "failed to update HEAD reference: "
-                  << ::git_error_last()->message << std::endl;
-        ::git_commit_free(target_commit);
-        ::git_reference_free(branch);
-        ::git_reference_free(ref);
-
-        return error;
-      }
-      target_head = ::git_reference_name(branch);
-    } else {
-      target_head = ::git_annotated_commit_ref(target);
-    }
+  while ((error = ::git_reference_next(outPtr(ref), it.get())) == GIT_OK) {
+    ObjectPtr commit;
 
-    error = ::git_repository_set_head(repo, target_head);
-  } else {
-    error = ::git_repository_set_head_detached_from_annotated(repo, target);
-  }
+    // Refs to anything but a commit cannot be checked out anyway
+    if (::git_reference_peel(outPtr(commit),
+                             ref.get(),
+                             GIT_OBJECT_COMMIT) == GIT_OK) {
+      std::string name { ::git_reference_name(ref.get()) };
+      refs[name] = *::git_object_id(commit.get());
 
-  if (error != 0) {
-    std::cerr << "failed to update HEAD reference: "
-              << ::git_error_last()->message << std::endl;
+      if (name.compare(0, remotes.size(), remotes) == 0) {
+        size_t slash = name.find('/', remotes.size());
+        if (slash != std::string::npos and
+            name.compare(slash + 1, std::string::npos, "HEAD") != 0)
+          remoteBranches.emplace(name.substr(slash + 1),
+                                 *::git_object_id(commit.get()));
+      }
+    }
   }
 
-  ::git_commit_free(target_commit);
-  ::git_reference_free(branch);
-  ::git_reference_free(ref);
-
-  return error;
+  return error == GIT_ITEROVER ? GIT_OK : error;
 }
 
-int
-checkoutGitRepoFromName(::git_repository* repo,
-                        const std::string& name,
-                        Options& options) {
-  ::git_annotated_commit *commit;
-  int error;
+bool
+RefIndex::resolve(const std::string& name, ::git_oid* oid) const {
+  // Same precedence as git_reference_dwim
+  const std::string candidates[] = { name,
+                                     "refs/" + name,
+                                     "refs/tags/" + name,
+                                     "refs/heads/" + name,
+                                     "refs/remotes/" + name,
+                                     "refs/remotes/" + name + "/HEAD" };
+
+  for (const auto& candidate : candidates) {
+    auto it = refs.find(candidate);
+    if (it != refs.end()) {
+      *oid = it->second;
+      return true;
+    }
+  }
 
-  if ((error = getAnnotatedCommitFromName(&commit,
-                                          repo,
-                                          name) < GIT_OK)
-      and
-      (error = getAnnotatedCommitFromGuessingName(&commit,
-                                                  repo,
-                                                  name) < GIT_OK)) {
-    std::cerr << "Failed to resolve " << name << ": "
-              << ::git_error_last()->message << std::endl;
-    return error;
+  // A branch that only exists on a remote, as right after a clone
+  auto it = remoteBranches.find(name);
+  if (it != remoteBranches.end()) {
+    *oid = it->second;
+    return true;
   }
 
-  error = performCheckoutRef(repo, commit, name);
+  // Commit ids and other revision expressions
+  ObjectPtr obj, commit;
 
-  ::git_annotated_commit_free(commit);
+  if (!repo or
+      ::git_revparse_single(outPtr(obj), repo, name.c_str()) < GIT_OK)
+    return false;
 
-  return error;
+  if (::git_object_peel(outPtr(commit),
+                        obj.get(),
+                        GIT_OBJECT_COMMIT) < GIT_OK)
+    return false;
+
+  *oid = *::git_object_id(commit.get());
+  return true;
 }
 
-void
+// The entry type comes from the directory listing itself, so entries
+// that end up ignored are never stat'd.
+bool
 splitFilesDirs(std::set<fs::path>& dirs,
                std::set<fs::path>& files,
-               const fs::path& path) {
-  if (fs::is_directory(path))
-    dirs.insert(path.filename());
+               const fs::directory_entry& entry,
+               const IgnoreRules& ignoreRules,
+               const fs::path& relDir) {
+  bool isDir = entry.is_directory();
+  fs::path name { entry.path().filename() };
+
+  if (ignoreRules.isIgnored(relDir / name, isDir))
+    return false;
+
+  if (isDir)
+    dirs.insert(name);
   else
-    files.insert(path.filename());
+    files.insert(name);
+
+  return true;
 }
 
 void
@@ -982,6 +1237,11 @@ diffFiles(fs::path file1,
   std::vector<char> buffer1(begin1, end1);
   std::vector<char> buffer2(begin2, end2);
 
+  std::error_code error;
+  Metrics::add(FILES_COMPARED);
+  Metrics::add(BYTES_COMPARED, fs::file_size(file1, error));
+  Metrics::add(BYTES_COMPARED, fs::file_size(file2, error));
+
   return buffer1 == buffer2;
 }
 
@@ -1023,15 +1283,32 @@ void
 diffDirAction(::git_repository* repo,
               fs::path srcDir,
               fs::path dstDir,
+              const IgnoreRules& ignoreRules,
+              StatCache& statCache,
+              CompareEngine& compareEngine,
+              ChangeList& changes,
               Options& options,
-              bool isRoot) {
+              bool isRoot,
+              fs::path relDir) {
   enum IDX_DIRAndFiles { SRCFILES, SRCDIRS, DSTFILES, DSTDIRS };
   std::set<fs::path> dirAndFiles[4];
 
-  for (const auto& entry : fs::directory_iterator(srcDir))
-    splitFilesDirs(dirAndFiles[SRCDIRS], dirAndFiles[SRCFILES], entry.path());
-  for (const auto& entry : fs::directory_iterator(dstDir))
-    splitFilesDirs(dirAndFiles[DSTDIRS], dirAndFiles[DSTFILES], entry.path());
+  size_t listed = 0;
+  // A directory leading to an asset directory outlives the source one
+  if (isRoot or fs::is_directory(srcDir))
+    for (const auto& entry : fs::directory_iterator(srcDir)) {
+      listed++;
+      if (!splitFilesDirs(dirAndFiles[SRCDIRS], dirAndFiles[SRCFILES],
+                          entry, ignoreRules, relDir))
+        options.entriesPruned++;
+    }
+  // Ignored entries on dst are left alone, as the root .git is
+  for (const auto& entry : fs::directory_iterator(dstDir)) {
+    listed++;
+    splitFilesDirs(dirAndFiles[DSTDIRS], dirAndFiles[DSTFILES],
+                   entry, ignoreRules, relDir);
+  }
+  Metrics::add(FILES_LISTED, listed);
 
   // When is on the root it must ignore the same directories and files
   if (isRoot) {
@@ -1051,24 +1328,37 @@ diffDirAction(::git_repository* repo,
         cleanIgnoreSet(dirAndFiles[i], ignoreDirs);
   }
 
-  // Check if the same named files has internal differences between them
+  // Check if the same named files has internal differences between them,
+  // reading them all at once
   std::set<fs::path> workSet;
   setIntersection(dirAndFiles[SRCFILES], dirAndFiles[DSTFILES], workSet);
+  std::vector<FilePair> pairs;
   for (std::set<fs::path>::iterator it = workSet.begin();
-       workSet.end() != it; ++it) {
-    fs::path sFile(srcDir);
-    sFile /= *it;
-    fs::path dFile(dstDir);
-    dFile /= *it;
+       workSet.end() != it; ++it)
+    pairs.emplace_back(srcDir / *it, dstDir / *it);
+
+  std::vector<CompareResult> results;
+  compareEngine.compare(statCache, pairs, results);
+
+  for (size_t i = 0; i < pairs.size(); i++) {
+    const fs::path& sFile = pairs[i].first;
+    const fs::path& dFile = pairs[i].second;
 
-    if (!diffFiles(sFile, dFile)) {
+    if (results[i] == SAME_STAT)
+      continue;
+
+    if (results[i] == DIFFERENT) {
       fs::copy(sFile, dFile, fs::copy_options::overwrite_existing);
+      Metrics::add(FILES_COPIED);
       fs::path dRelPath;
       // fs::path currDir { fs::current_path() };
       // getRelativePathFrom(dFile, currDir, dRelPath);
       getRelativePathFromCurrDir(dFile, dRelPath);
       addPath2GitRepo(repo, dRelPath, options);
+      changes.emplace_back(dRelPath.generic_string(), FILE_MODIFIED);
     }
+
+    statCache.store(sFile, dFile);
   }
 
   // Which files are new on the src and doesn't exists on dst
@@ -1081,9 +1371,12 @@ diffDirAction(::git_repository* repo,
     dFile /= *it;
 
     fs::copy(sFile, dFile);
+    Metrics::add(FILES_COPIED);
     fs::path dRelPath;
     getRelativePathFromCurrDir(dFile, dRelPath);
     addPath2GitRepo(repo, dRelPath, options);
+    changes.emplace_back(dRelPath.generic_string(), FILE_ADDED);
+    statCache.store(sFile, dFile);
   }
 
   // Which files exists on dst but doesn't exists on src
@@ -1095,7 +1388,9 @@ diffDirAction(::git_repository* repo,
     fs::path dRelPath;
     getRelativePathFromCurrDir(dFile, dRelPath);
     removePath2GitRepo(repo, dRelPath, options);
+    changes.emplace_back(dRelPath.generic_string(), FILE_DELETED);
     fs::remove(dFile);
+    Metrics::add(FILES_REMOVED);
   }
 
   // Which directories are newer and they must be created on dst
@@ -1113,9 +1408,25 @@ diffDirAction(::git_repository* repo,
        workSet.end() != it; ++it) {
     fs::path dDir(dstDir);
     dDir /= *it;
+
+    // Only what it holds besides the asset directory goes
+    if (ignoreRules.leadsToProtected(relDir / *it)) {
+      diffDirAction(repo,
+                    srcDir / *it,
+                    dDir,
+                    ignoreRules,
+                    statCache,
+                    compareEngine,
+                    changes,
+                    options,
+                    false,
+                    relDir / *it);
+      continue;
+    }
+
     fs::path dRelPath;
     getRelativePathFromCurrDir(dDir, dRelPath);
-    removeDir2GitRepo(repo, dRelPath.c_str(), options);
+    removeDir2GitRepo(repo, dRelPath.c_str(), changes, options);
   }
 
   // Recursive calling
@@ -1128,54 +1439,89 @@ diffDirAction(::git_repository* repo,
     diffDirAction(repo,
                   sDir,
                   dDir,
-                  options);
+                  ignoreRules,
+                  statCache,
+                  compareEngine,
+                  changes,
+                  options,
+                  false,
+                  relDir / *it);
   }
 }
 
 void
 stopProcessing(int pagesProcessed, int commitDone, Options& options) {
+  std::ostringstream throughput;
+  ProgressMeter::report(throughput);
+  Log::write(LOG_INFO, throughput.str());
+
+  // ru_maxrss is in kilobytes on Linux
+  struct rusage usage;
+  long peakRSS = ::getrusage(RUSAGE_SELF, &usage) == 0 ?
+    usage.ru_maxrss / 1024 : 0;
+
+  LogLine(LOG_INFO, "Story built")
+    .field("pages", pagesProcessed)
+    .field("commits", commitDone)
+    .field("entries_pruned", options.entriesPruned)
+    .field("stat_unchanged", options.statCacheHits)
+    .field("peak_rss_mb", peakRSS);
+}
+
+void
+shutdownGitLibrary(Options& options) {
   int error;
   while ((error = ::git_libgit2_shutdown()) != 0) {
     if (error < GIT_OK)
       m_giterror(error, "Libgit2 shutdown has failed", options);
   }
+}
 
-  std::cout << "Pages processed: " << pagesProcessed << std::endl;
-  std::cout << "Commit done: " << commitDone << std::endl;
+void
+limitGitMemory(size_t budget, Options& options) {
+  // A quarter for decoded objects, half for mapped packs, in windows
+  // small enough that several packs fit
+  ssize_t cacheSize = budget / 4;
+  size_t mappedLimit = budget / 2;
+  size_t windowSize = std::max<size_t>(mappedLimit / 8, 1024 * 1024);
+
+  m_giterror(::git_libgit2_opts(GIT_OPT_SET_CACHE_MAX_SIZE, cacheSize),
+             "Cannot limit the object cache",
+             options);
+  m_giterror(::git_libgit2_opts(GIT_OPT_SET_MWINDOW_MAPPED_LIMIT,
+                                mappedLimit),
+             "Cannot limit the mapped pack memory",
+             options);
+  m_giterror(::git_libgit2_opts(GIT_OPT_SET_MWINDOW_SIZE, windowSize),
+             "Cannot limit the pack window size",
+             options);
 }
 
-::git_commit*
+CommitPtr
 getFirstCommitOid(::git_repository* repo, Options& options) {
   ::git_oid oid;
-  ::git_revwalk *walker = nullptr;
+  RevwalkPtr walker;
 
-  m_giterror(::git_revwalk_new(&walker, repo),
+  m_giterror(::git_revwalk_new(outPtr(walker), repo),
              "Couldn't create revision walker",
              options);
 
-  ::git_commit* firstCommit = nullptr;
+  CommitPtr firstCommit;
 
   // TODO This is dangerous, because I'm assuming that
   // This error is valid when the repository is empty
   // m_giterror(::git_revwalk_push_head(walker),
   //            "Couldn't find revision HEAD",
   //            options);
-  int error = ::git_revwalk_push_head(walker);
+  int error = ::git_revwalk_push_head(walker.get());
 
   if (error < GIT_OK) return firstCommit;
 
-  ::git_commit *commit = nullptr;
-
-  for (; !::git_revwalk_next(&oid, walker); ::git_commit_free(commit)) {
-
-    m_giterror(::git_commit_lookup(&commit, repo, &oid),
+  // The walk ends at the root, the last commit seen is the first one
+  while (!::git_revwalk_next(&oid, walker.get())) {
+    m_giterror(::git_commit_lookup(outPtr(firstCommit), repo, &oid),
                "Failed to look up commit",
                options);
-
-    if (firstCommit)
-      ::git_commit_free(firstCommit);
-
-    ::git_commit_dup(&firstCommit, commit);
   }
 
   return firstCommit;
@@ -1185,41 +1531,11 @@ void
 commitAmendGitRepo(::git_repository* repo,
                    std::string& message,
                    ::git_commit *firstCommit,
-                   Options& options) {
-  ::git_config *config_default;
-
-  m_giterror(::git_config_open_default(&config_default),
-             "Cannot open default configuration",
-             options);
+                   Options& options,
+                   int pageNumber) {
+  SignaturePtr signature = createSignature(pageNumber, options);
 
-  ::git_config_entry *entry;
-
-  m_giterror(::git_config_get_entry(&entry,
-                                    config_default,
-                                    "user.name"),
-             "Cannot find user name at default config",
-             options);
-
-  std::string userName { entry->value };
-  ::git_config_entry_free(entry);
-
-  m_giterror(::git_config_get_entry(&entry,
-                                    config_default,"user.email"),
-             "Cannot find user email at default config",
-             options);
-
-  std::string userEmail { entry->value };
-  ::git_config_entry_free(entry);
-
-  ::git_signature *signature = nullptr;
-
-  m_giterror(::git_signature_now(&signature,
-                                 userName.c_str(),
-                                 userEmail.c_str()),
-             "Cannot create user signature",
-             options);
-
-  ::git_index *index;
+  IndexPtr index;
 
   // int error;
   // if ((error = ::git_revparse_ext(&parent,
@@ -1232,25 +1548,25 @@ commitAmendGitRepo(::git_repository* repo,
   //              options);
   // }
 
-  m_giterror(::git_repository_index(&index,
+  m_giterror(::git_repository_index(outPtr(index),
                                     repo),
              "Could not open repository index",
              options);
 
   ::git_oid tree_oid;
 
-  m_giterror(::git_index_write_tree(&tree_oid,
-                                    index),
+  m_giterror(writeIndexTree(&tree_oid,
+                            index.get()),
              "Could not write tree",
              options);
 
-  m_giterror(::git_index_write(index),
+  m_giterror(writeIndex(index.get()),
              "Could not write index",
              options);
 
-  ::git_tree* tree = nullptr;
+  TreePtr tree;
 
-  ::git_tree_lookup(&tree,
+  ::git_tree_lookup(outPtr(tree),
                     repo,
                     &tree_oid);
 
@@ -1261,36 +1577,32 @@ commitAmendGitRepo(::git_repository* repo,
   m_giterror(::git_commit_amend(&new_commit_id,
                                 firstCommit,
                                 "HEAD",
-                                signature,
-                                signature,
+                                signature.get(),
+                                signature.get(),
                                 "UTF-8",
                                 message.c_str(),
-                                tree),
+                                tree.get()),
              "Couldn't amend last commit",
              options);
-
-  ::git_index_free(index);
-  ::git_tree_free(tree);
-  // ::git_object_free(parent);
-  // ::git_reference_free(ref);
+  Metrics::add(COMMITS_CREATED);
 }
 
-::git_repository*
+RepositoryPtr
 initLocalRepository(fs::path& repoPath,
                     Options& options) {
   std::string error_msg { "Repo: " };
   error_msg += repoPath;
   error_msg += " cannot be initialize";
 
-  ::git_repository* repo = nullptr;
-  m_giterror(::git_repository_init(&repo,
+  RepositoryPtr repo;
+  m_giterror(::git_repository_init(outPtr(repo),
                                    repoPath.c_str(),
                                    false),
              error_msg.c_str(),
              options);
 
-  ::git_index *idx = nullptr;
-  m_giterror(::git_repository_index(&idx, repo),
+  IndexPtr idx;
+  m_giterror(::git_repository_index(outPtr(idx), repo.get()),
              "Repo Index cannot be obtained",
              options);
 
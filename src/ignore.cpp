@@ -0,0 +1,180 @@
+#include "ignore.h"
+#include <fstream>
+
+// Wildcard matching with gitignore semantics: '*' and '?' stop at '/',
+// '**' crosses directories and "**/" also matches no directory at all.
+static bool
+matchGlob(const char* pat, const char* str) {
+  while (*pat) {
+    switch (*pat) {
+    case '*':
+      if (pat[1] == '*') {
+        pat += 2;
+        if (*pat == '/' and matchGlob(pat + 1, str))
+          return true;
+        for (; *str; ++str)
+          if (matchGlob(pat, str)) return true;
+        return matchGlob(pat, str);
+      }
+      ++pat;
+      for (;; ++str) {
+        if (matchGlob(pat, str)) return true;
+        if (!*str or *str == '/') return false;
+      }
+    case '?':
+      if (!*str or *str == '/') return false;
+      ++pat;
+      ++str;
+      break;
+    case '[':
+      {
+        if (!*str or *str == '/') return false;
+        const char* q = pat + 1;
+        bool negate = (*q == '!' or *q == '^');
+        if (negate) ++q;
+        const char* first = q;
+        bool matched = false;
+        for (; *q and (*q != ']' or q == first); ++q) {
+          if (q[1] == '-' and q[2] and q[2] != ']') {
+            if (q[0] <= *str and *str <= q[2]) matched = true;
+            q += 2;
+          }
+          else if (*q == *str) matched = true;
+        }
+        if (!*q or matched == negate) return false;
+        pat = q + 1;
+        ++str;
+      }
+      break;
+    case '\\':
+      if (pat[1]) ++pat;
+      [[fallthrough]];
+    default:
+      if (*pat != *str) return false;
+      ++pat;
+      ++str;
+      break;
+    }
+  }
+
+  return *str == '\0';
+}
+
+bool
+IgnoreRules::load(const fs::path& ignoreFile) {
+  std::ifstream input(ignoreFile);
+
+  if (!input) return false;
+
+  std::string line;
+  while (std::getline(input, line))
+    add(line);
+
+  return true;
+}
+
+void
+IgnoreRules::add(const std::string& line) {
+  std::string glob { line };
+
+  if (!glob.empty() and glob.back() == '\r')
+    glob.pop_back();
+
+  while (!glob.empty() and glob.back() == ' ' and
+         (glob.size() < 2 or glob[glob.size() - 2] != '\\'))
+    glob.pop_back();
+
+  if (glob.empty() or glob[0] == '#') return;
+
+  bool negated = false;
+  if (glob[0] == '!') {
+    negated = true;
+    glob.erase(0, 1);
+  }
+  else if (glob[0] == '\\' and glob.size() > 1 and
+           (glob[1] == '#' or glob[1] == '!'))
+    glob.erase(0, 1);
+
+  bool dirOnly = false;
+  if (!glob.empty() and glob.back() == '/') {
+    dirOnly = true;
+    glob.pop_back();
+  }
+
+  if (glob.empty()) return;
+
+  bool anchored = glob.find('/') != std::string::npos;
+  if (glob[0] == '/')
+    glob.erase(0, 1);
+
+  patterns.push_back(IgnorePattern(glob, negated, dirOnly, anchored));
+}
+
+void
+IgnoreRules::limitTo(const std::vector<std::string>& prefixes) {
+  scope = prefixes;
+}
+
+void
+IgnoreRules::protect(const std::string& dir) {
+  std::string path { fs::path(dir).lexically_normal().generic_string() };
+
+  while (!path.empty() and path.back() == '/')
+    path.pop_back();
+
+  if (path.empty()) return;
+
+  add("/" + path + "/");
+  protectedDirs.push_back(path);
+}
+
+bool
+IgnoreRules::leadsToProtected(const fs::path& relDir) const {
+  const std::string path { relDir.generic_string() };
+
+  for (const auto& dir : protectedDirs)
+    if (dir.compare(0, path.size(), path) == 0 and
+        dir.size() > path.size() and dir[path.size()] == '/')
+      return true;
+
+  return false;
+}
+
+bool
+IgnoreRules::inScope(const std::string& path, bool isDir) const {
+  for (const auto& prefix : scope) {
+    if (path.compare(0, prefix.size(), prefix) == 0 and
+        (path.size() == prefix.size() or path[prefix.size()] == '/'))
+      return true;
+
+    if (isDir and prefix.compare(0, path.size(), path) == 0 and
+        prefix.size() > path.size() and prefix[path.size()] == '/')
+      return true;
+  }
+
+  return false;
+}
+
+bool
+IgnoreRules::isIgnored(const fs::path& relPath, bool isDir) const {
+  if (empty()) return false;
+
+  const std::string path { relPath.generic_string() };
+
+  if (!scope.empty() and !inScope(path, isDir)) return true;
+
+  const std::string name { relPath.filename().string() };
+  bool ignored = false;
+
+  for (const auto& p : patterns) {
+    // Only a pattern that would flip the current verdict is worth matching
+    if (p.negated != ignored) continue;
+    if (p.dirOnly and !isDir) continue;
+
+    const std::string& subject = p.anchored ? path : name;
+    if (matchGlob(p.glob.c_str(), subject.c_str()))
+      ignored = !p.negated;
+  }
+
+  return ignored;
+}
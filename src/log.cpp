@@ -0,0 +1,161 @@
+#include "log.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+typedef std::pair<LogLevel, std::string> LogEntry;
+
+static std::atomic<int> shownLevel { LOG_INFO };
+static std::mutex logMutex;
+static std::condition_variable queuedCondition;
+static std::condition_variable writtenCondition;
+static std::vector<LogEntry> queue;
+static size_t queuedEntries { 0 };
+static size_t writtenEntries { 0 };
+static bool running { false };
+static std::thread writer;
+
+static void
+writeEntries(const std::vector<LogEntry>& entries) {
+  bool out = false, err = false;
+
+  for (const auto& entry : entries) {
+    if (entry.first <= LOG_WARNING) {
+      std::cerr << entry.second;
+      err = true;
+    }
+    else {
+      std::cout << entry.second;
+      out = true;
+    }
+  }
+
+  if (out)
+    std::cout.flush();
+  if (err)
+    std::cerr.flush();
+}
+
+static void
+writeQueue() {
+  std::vector<LogEntry> batch;
+  std::unique_lock<std::mutex> lock(logMutex);
+
+  for (;;) {
+    queuedCondition.wait(lock, [] { return !queue.empty() or !running; });
+    if (queue.empty())
+      break;
+
+    batch.swap(queue);
+    lock.unlock();
+    writeEntries(batch);
+    lock.lock();
+
+    writtenEntries += batch.size();
+    batch.clear();
+    writtenCondition.notify_all();
+  }
+}
+
+void
+Log::start(LogLevel verbosity) {
+  shownLevel = verbosity;
+
+  std::lock_guard<std::mutex> lock(logMutex);
+  if (running)
+    return;
+  running = true;
+  writer = std::thread(writeQueue);
+  // m_giterror and the other fatal errors leave through exit()
+  std::atexit(Log::stop);
+}
+
+void
+Log::stop() {
+  {
+    std::lock_guard<std::mutex> lock(logMutex);
+    if (!running)
+      return;
+    running = false;
+  }
+
+  queuedCondition.notify_one();
+  writer.join();
+}
+
+void
+Log::flush() {
+  std::unique_lock<std::mutex> lock(logMutex);
+  size_t target = queuedEntries;
+  writtenCondition.wait(lock, [target] {
+    return writtenEntries >= target or !running;
+  });
+}
+
+bool
+Log::enabled(LogLevel level) {
+  return level <= shownLevel.load(std::memory_order_relaxed);
+}
+
+void
+Log::write(LogLevel level, const std::string& text) {
+  if (!enabled(level))
+    return;
+
+  std::unique_lock<std::mutex> lock(logMutex);
+  if (!running) {
+    lock.unlock();
+    writeEntries({ LogEntry(level, text) });
+    return;
+  }
+
+  queue.emplace_back(level, text);
+  queuedEntries++;
+  lock.unlock();
+  queuedCondition.notify_one();
+}
+
+LogLine::LogLine(LogLevel level, const std::string& message) :
+  level(level),
+  enabled(Log::enabled(level)),
+  text() {
+  if (enabled)
+    text = message;
+}
+
+LogLine::~LogLine() {
+  if (enabled)
+    Log::write(level, text + '\n');
+}
+
+// Values with blanks, quotes or an equal sign are quoted
+LogLine&
+LogLine::field(const char* key, const std::string& value) {
+  if (!enabled)
+    return *this;
+
+  text += ' ';
+  text += key;
+  text += '=';
+
+  if (!value.empty() and
+      value.find_first_of(" \t\"=") == std::string::npos) {
+    text += value;
+    return *this;
+  }
+
+  text += '"';
+  for (char c : value) {
+    if (c == '"' or c == '\\')
+      text += '\\';
+    text += c;
+  }
+  text += '"';
+
+  return *this;
+}
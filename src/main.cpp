@@ -1,27 +1,14 @@
 #include <iostream>
-#include <fstream>
-#include <sstream>
 #include <cstdlib>
-#include <iomanip>
 #include <string>
-#include <cstring>
+#include <cctype>
+#include <cstdint>
 #include <filesystem>
 #include <getopt.h>
-#include <git2.h>
 #include "md2cs_config.h"
 #include "helper.h"
 
-const std::string ORIGIN     { "ORIGIN" };
-const char* READMEFILENAME   { "README.md" };
-const char* STORYFILENAME    { "story.md" };
-const char* DOTSTORYFILENAME { ".story.md" };
-const char* TARGETDIR        { "target" };
-const char* REPOSITORIESDIR  { "repositories" };
-const char* REPOSITORYDIR    { "repository" };
-const char* DEFAULTBRANCH    { "main" };
-const char* STARTXMLCOMMENT  { "<!--" };
-
-inline const char* getOutputFilename(bool);
+const char* SOURCEDATEEPOCH  { "SOURCE_DATE_EPOCH" };
 
 static void version(const char* progname) {
   std::cerr << progname << " version: "
@@ -42,12 +29,87 @@ static void usage(const char* progname,
             << " -h | --help"
             << std::endl;
   std::cerr << progname
-            << " [-d] [[-n] <number-pages-process>|[--number-pages-process]"
+            << " [-d|-q] [[-n] <number-pages-process>|[--number-pages-process]"
             << " <number-pages-process>] [-u]"
+            << " [[-l] <pages>|[--lookahead] <pages>] [-D|--deterministic]"
+            << " [[-f] <file|->|[--emit-fast-import] <file|->]"
+            << " [[-b] <file|->|[--bundle] <file|->"
+            << " [[-B] <revision>|[--bundle-basis] <revision>]]"
+            << " [-r|--resume] [[-m] <file>|[--metrics] <file>]"
+            << " [[-j] <threads>|[--io-threads] <threads>]"
+            << " [-M|--multi-pack-index]"
+            << " [[-x] <size>|[--max-memory] <size>]"
+            << " [[-a] <dir>|[--export-archives] <dir>]"
+            << " [[-i] <file>|[--diff-index] <file>]"
             << std::endl;
   ::exit(status);
 }
 
+// A count of at least one. 0 when invalid.
+static int
+parseCount(const std::string& count) {
+  size_t end = 0;
+  int value = 0;
+
+  try {
+    value = std::stoi(count, &end);
+  }
+  catch (const std::exception&) {
+    return 0;
+  }
+
+  return end == count.size() and value > 0 ? value : 0;
+}
+
+// Whole seconds since 1970, as SOURCE_DATE_EPOCH holds them. False when
+// invalid.
+static bool
+parseEpoch(const std::string& text, long long& epoch) {
+  size_t end = 0;
+
+  try {
+    epoch = std::stoll(text, &end);
+  }
+  catch (const std::exception&) {
+    return false;
+  }
+
+  return end == text.size() and epoch >= 0;
+}
+
+// A size in bytes, with an optional K, M or G suffix. 0 when invalid.
+static size_t
+parseByteSize(const std::string& size) {
+  size_t end = 0;
+  unsigned long long value = 0;
+
+  try {
+    value = std::stoull(size, &end);
+  }
+  catch (const std::exception&) {
+    return 0;
+  }
+
+  std::string suffix { size.substr(end) };
+  int shift = 0;
+  if (suffix.size() > 1)
+    return 0;
+
+  if (!suffix.empty())
+    switch (std::toupper(suffix[0])) {
+    case 'K': shift = 10; break;
+    case 'M': shift = 20; break;
+    case 'G': shift = 30; break;
+    default: return 0;
+    }
+
+  // A size that does not fit would wrap around to a small budget
+  if (value > (SIZE_MAX >> shift))
+    return 0;
+
+  return value << shift;
+}
+
 int
 main(int argc, char *argv[]) {
 
@@ -66,11 +128,24 @@ main(int argc, char *argv[]) {
       {"version", no_argument,       0,  'v'},
       {"help",    no_argument,       0,  'h'},
       {"number-pages-process", required_argument, 0, 'n'},
+      {"lookahead", required_argument, 0, 'l'},
+      {"deterministic", no_argument, 0, 'D'},
+      {"emit-fast-import", required_argument, 0, 'f'},
+      {"bundle", required_argument, 0, 'b'},
+      {"bundle-basis", required_argument, 0, 'B'},
+      {"resume", no_argument, 0, 'r'},
+      {"metrics", required_argument, 0, 'm'},
+      {"io-threads", required_argument, 0, 'j'},
+      {"multi-pack-index", no_argument, 0, 'M'},
+      {"max-memory", required_argument, 0, 'x'},
+      {"export-archives", required_argument, 0, 'a'},
+      {"quiet", no_argument, 0, 'q'},
+      {"diff-index", required_argument, 0, 'i'},
       {0,         0,                 0,  0 }
     };
 
     c = ::getopt_long(argc, argv,
-                      "dhvn:u",
+                      "dhvn:ul:Df:b:B:rm:j:Mx:a:qi:",
                       long_options,
                       &option_index);
     if (c == -1)
@@ -79,6 +154,11 @@ main(int argc, char *argv[]) {
     switch (c) {
     case 'd':
       options.debug = true;
+      options.verbosity = LOG_DEBUG;
+      break;
+
+    case 'q':
+      options.verbosity = LOG_WARNING;
       break;
 
     case 'v':
@@ -100,355 +180,97 @@ main(int argc, char *argv[]) {
       options.upload = true;
       break;
 
-    case '?':
-    default:
-      usage(progname, EXIT_FAILURE);
+    case 'l':
+      options.lookahead = parseCount(optarg);
+      if (!options.lookahead)
+        usage(progname, EXIT_FAILURE);
       break;
-    }
-  }
-
-  processStoryFile(options);
-
-  return EXIT_SUCCESS;
-}
 
-void
-processStoryFile(Options &options) {
-
-  std::string currExtRepo;
-  CheckoutType currCheckoutType { BRANCH };
-  std::string currCheckoutName;
-  std::string message;
-  std::map<std::string, RepoDesc*> extRepos;
-
-  fs::path storyDir { fs::current_path() };
-
-  fs::path storyFile = { fs::current_path() /
-                         STORYFILENAME };
-
-  if (!fs::exists(storyFile)) {
-    std::cerr << "file: "
-              << storyFile
-              << " doesn't exists" << std::endl;
-    return;
-  }
-
-  options.targetPath = (fs::current_path() / TARGETDIR);
-
-  fs::path targetReposPath { options.targetPath /
-                             REPOSITORIESDIR };
-  fs::path targetRepoPath { options.targetPath /
-                            REPOSITORYDIR };
-  fs::path readMeRepoPath { options.targetPath /
-                            REPOSITORYDIR };
-
-  m_giterror(::git_libgit2_init(),
-             "Cannot initialize libgit2",
-             options);
-
-  if (fs::exists(options.targetPath)) {
-    fs::remove_all(options.targetPath);
-  }
+    case 'D':
+      {
+        options.deterministic = true;
+        const char* epoch { std::getenv(SOURCEDATEEPOCH) };
+        if (epoch and *epoch and !parseEpoch(epoch, options.epoch)) {
+          std::cerr << SOURCEDATEEPOCH << " is not a number of seconds: "
+                    << epoch << std::endl;
+          usage(progname, EXIT_FAILURE);
+        }
+      }
+      break;
 
-  fs::create_directory(options.targetPath);
-  fs::create_directory(targetReposPath);
-  fs::create_directory(targetRepoPath);
+    case 'f':
+      {
+        std::string f { optarg };
+        // Pages run from the target directories, the file is taken from here
+        options.fastImportFile = f == STDOUTFILENAME ?
+          f : fs::absolute(f).string();
+      }
+      break;
 
-  std::string error_msg { "Repo: " };
-  error_msg += targetRepoPath;
-  error_msg += " cannot be initialize";
+    case 'b':
+      {
+        std::string b { optarg };
+        options.bundleFile = b == STDOUTFILENAME ?
+          b : fs::absolute(b).string();
+      }
+      break;
 
-  ::git_repository *repo = nullptr;
+    case 'B':
+      options.bundleBasis = optarg;
+      break;
 
-  std::ifstream input(storyFile);
+    case 'r':
+      options.resume = true;
+      break;
 
-  if (!input) {
-    std::cerr << "Cannot open: "
-              << storyFile
-              << std::endl;
+    case 'm':
+      options.metricsFile = fs::absolute(optarg).string();
+      break;
 
-    if (!options.debug) fs::remove_all(options.targetPath);
+    case 'j':
+      options.ioThreads = parseCount(optarg);
+      if (!options.ioThreads)
+        usage(progname, EXIT_FAILURE);
+      break;
 
-    return;
-  }
+    case 'M':
+      options.multiPackIndex = true;
+      break;
 
-  fs::current_path(targetRepoPath);
+    case 'x':
+      options.maxMemory = parseByteSize(optarg);
+      if (!options.maxMemory)
+        usage(progname, EXIT_FAILURE);
+      break;
 
-  std::cout << "Opening and processing: "
-            << storyFile
-            << std::endl;
-  std::cout << "Working at: "
-            << fs::current_path()
-            << std::endl;
+    case 'a':
+      options.archivesDir = fs::absolute(optarg).string();
+      break;
 
-  std::string line;
-
-  enum FILEPROCESS { INCONFIG, OUTCONFIG };
-  FILEPROCESS state = OUTCONFIG;
-  int pagesProcessed = 0;
-  int commitDone = 0;
-  std::ostringstream* pBuffer = new std::ostringstream();
-  bool firstPage = true;
-  bool isFirstCommit = true;
-  ::git_commit* firstCommit = nullptr;
-
-  while (std::getline(input,line)) {
-    const std::regex line_regex("^(-|=){3}(-|=)* *$");
-    if (std::regex_match(line,line_regex)) {
-      switch(state) {
-      case INCONFIG:
-        state = OUTCONFIG;
-        if (pBuffer)
-          (*pBuffer) << transTex2HTMLEntity(line) << std::endl;
-        if (!currCheckoutName.empty()) {
-
-          std::cout << (currCheckoutType == BRANCH ? "Branch" : "Tag")
-                    << " to checkout: " << currCheckoutName
-                    << " from repo " << currExtRepo << std::endl;
-
-          fs::path curDir { fs::current_path() };
-          fs::current_path(extRepos[currExtRepo]->repoDir);
-
-          m_giterror(checkoutGitRepoFromName(extRepos[currExtRepo]->repo,
-                                             currCheckoutName,
-                                             options),
-                     "Checkout failed",
-                     options);
-
-          fs::current_path(curDir);
-
-          diffDirAction(repo,
-                        extRepos[currExtRepo]->repoDir,
-                        curDir,
-                        options, true);
-
-          currCheckoutName.clear();
-        }
-        break;
-      case OUTCONFIG:
-        {
-          state = INCONFIG;
-
-          if (pBuffer->tellp() > 0) {
-            pagesProcessed++;
-            addBuffer2GitRepo(repo,
-                              pBuffer,
-                              getOutputFilename(firstPage),
-                              options);
-            delete pBuffer;
-            pBuffer = new std::ostringstream();
-            if (pBuffer)
-              (*pBuffer) << transTex2HTMLEntity(line) << std::endl;
-
-            if (firstPage) {
-              firstPage = false;
-            }
-            else {
-              commitDone++;
-
-              if (firstCommit && isFirstCommit && options.upload) {
-                commitAmendGitRepo(repo,
-                                   message,
-                                   firstCommit,
-                                   options);
-              }
-              else {
-                commitGitRepo(repo,
-                              message,
-                              options);
-              }
-
-              isFirstCommit = false;
-            }
-
-            if (pagesProcessed == options.pagesProcessed) {
-              stopProcessing(pagesProcessed,
-                             commitDone,
-                             options);
-              return;
-            }
-          }
-        }
-        break;
-      }
-    }
-    else {
-      switch (state) {
-      case INCONFIG:
-        {
-          const std::regex cfg_regex("(^.*): +(.*)");
-          std::smatch cfg;
-
-          if (std::regex_match(line, cfg, cfg_regex)) {
-
-            if (cfg[1] == "repository") {
-              std::string currURLExtRepo;
-              currURLExtRepo = cfg[2];
-              fs::path curDir { fs::current_path() };
-              fs::current_path(targetReposPath);
-              fs::path newRepo;
-              RepoDesc *rd = url2RepoDesc(currURLExtRepo);
-              if (rd) {
-                std::cout << "protocol: " << rd->protocol
-                          << " host: " << rd->host
-                          << " user: " << rd->user
-                          << " repoName: " << rd->repoName
-                          << std::endl;
-                newRepo.clear();
-                newRepo = rd->repoName;
-                rd->repoDir = fs::current_path() / newRepo;
-                rd->checkoutName = DEFAULTBRANCH;
-                rd->checkoutType = BRANCH;
-                currExtRepo = rd->repoName;
-                extRepos[currExtRepo] = rd;
-              }
-              else {
-                std::cerr << "Incorrect repo url"
-                          << std::endl;
-              }
-              m_giterror(cloneGitRepo(newRepo,
-                                      currURLExtRepo,
-                                      rd,
-                                      options),
-                         "Clone failed",
-                         options);
-              fs::current_path(curDir);
-            }
-
-            if (cfg[1] == "branch") {
-              currCheckoutType = BRANCH;
-              currCheckoutName.clear();
-              currCheckoutName = cfg[2];
-            }
-
-            if (cfg[1] == "tag") {
-              currCheckoutType = TAG;
-              currCheckoutName.clear();
-              currCheckoutName = cfg[2];
-            }
-
-            if (cfg[1] == "focus") {
-              if (pBuffer)
-                (*pBuffer) << transTex2HTMLEntity(line) << std::endl;
-            }
-
-            if (cfg[1] == "origin") {
-              ::git_remote *remote = nullptr;
-              std::string url { cfg[2] };
-
-              if (options.upload) {
-                RepoDesc *rd = url2RepoDesc(url);
-
-                if (!rd) {
-                  std::cerr << "Fatal error: "
-                            << "cannot create an Repository Description "
-                            << "for \"origin\" "
-                            << "url: "
-                            << url
-                            << std::endl;
-
-                  ::exit(EXIT_FAILURE);
-                }
-
-                std::cout << "protocol: " << rd->protocol
-                          << " host: " << rd->host
-                          << " user: " << rd->user
-                          << " repoName: " << rd->repoName
-                          << std::endl;
-
-                rd->repoDir = targetRepoPath;
-                rd->checkoutName = DEFAULTBRANCH;
-
-                m_giterror(cloneGitRepo(targetRepoPath,
-                                        url,
-                                        rd,
-                                        options),
-                           "Creating local repository of \"origin\"",
-                           options);
-
-                repo = rd->repo;
-                extRepos[ORIGIN] = rd;
-
-                firstCommit = getFirstCommitOid(repo,
-                                                options);
-
-                if (firstCommit) {
-                  resetUntilFirstCommit(repo, firstCommit, options);
-                }
-              }
-              else {
-                repo = initLocalRepository(targetRepoPath, options);
-                m_giterror(::git_remote_create(&remote,
-                                               repo,
-                                               "origin",
-                                               url.c_str()),
-                           "Creating remote entry",
-                           options);
-              }
-            }
-          }
-        }
-        break;
-      case OUTCONFIG:
-        const std::regex cfg_regex("^### +(.*)");
-        std::smatch cfg;
-        if (std::regex_match(line, cfg, cfg_regex)) {
-          message.clear();
-          message = cfg[1];
-        }
+    case 'i':
+      options.diffIndexFile = fs::absolute(optarg).string();
+      break;
 
-        if (pBuffer)
-          (*pBuffer) << transTex2HTMLEntity(line) << std::endl;
-        break;
-      }
+    case '?':
+    default:
+      usage(progname, EXIT_FAILURE);
+      break;
     }
   }
 
-  if (pBuffer)
-    (*pBuffer) << transTex2HTMLEntity(line) << std::endl;
-
-  pagesProcessed++;
-  addBuffer2GitRepo(repo,
-                    pBuffer,
-                    getOutputFilename(firstPage),
-                    options);
-
-  delete pBuffer;
-  if (firstPage) {
-    firstPage = false;
+  if (options.fastImportFile == STDOUTFILENAME and
+      options.bundleFile == STDOUTFILENAME) {
+    std::cerr << "Only one export can be written to the standard output"
+              << std::endl;
+    usage(progname, EXIT_FAILURE);
   }
-  else {
-    commitDone++;
-    if (firstCommit && isFirstCommit && options.upload) {
-      commitAmendGitRepo(repo,
-                         message,
-                         firstCommit,
-                         options);
-    }
-    else {
-      commitGitRepo(repo,
-                    message,
-                    options);
-    }
 
-    isFirstCommit = false;
-  }
+  if (options.fastImportFile == STDOUTFILENAME or
+      options.bundleFile == STDOUTFILENAME)
+    std::cout.rdbuf(std::cerr.rdbuf());
 
-  if (options.upload) {
-    std::cout << "Final Check" << std::endl;
-    m_giterror(pushGitRepo(repo,
-                           options,
-                           "refs/heads/main",
-                           firstCommit ? true : false),
-               "Error pushing", options);
-  }
+  Log::start(options.verbosity);
 
-  stopProcessing(pagesProcessed,
-                 commitDone,
-                 options);
+  return processStoryFile(fs::current_path(), options);
 }
 
-inline const char* getOutputFilename(bool isReadme) {
-  return isReadme ? READMEFILENAME :
-   DOTSTORYFILENAME;
-}
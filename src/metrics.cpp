@@ -0,0 +1,101 @@
+#include "metrics.h"
+#include "atomicfile.h"
+
+struct MetricInfo {
+  const char* name;
+  const char* help;
+  bool perPage;
+};
+
+const static MetricInfo METRICS[METRIC_COUNT] = {
+  { "files_listed",
+    "Directory entries listed in source and story trees", true },
+  { "files_compared",
+    "Files compared with their copy in the story repository", true },
+  { "files_copied",
+    "Files copied into the story repository", true },
+  { "files_removed",
+    "Files removed from the story repository", true },
+  { "compared_bytes",
+    "Bytes read to compare files", true },
+  { "index_writes",
+    "Writes of the story repository index", true },
+  { "blobs_written",
+    "Blobs the object database did not have, written from files", true },
+  { "trees_written",
+    "Trees that changed since the last commit, written from the index",
+    true },
+  { "commits_created",
+    "Commits created in the story repository", true },
+  { "clone_bytes",
+    "Bytes received while cloning", false },
+  { "push_bytes",
+    "Bytes sent while pushing", false },
+};
+
+const static char* METRIC_PREFIX { "md2cs_" };
+
+std::atomic<uint64_t> Metrics::counters[METRIC_COUNT];
+std::mutex Metrics::mutex;
+Metrics::Values Metrics::pageStart {};
+std::vector<std::pair<int, Metrics::Values>> Metrics::pages;
+
+void
+Metrics::endPage(int page) {
+  std::lock_guard<std::mutex> lock(mutex);
+  Values delta;
+
+  for (int id = 0; id < METRIC_COUNT; id++) {
+    uint64_t now = value(static_cast<MetricId>(id));
+    delta[id] = now - pageStart[id];
+    pageStart[id] = now;
+  }
+
+  pages.emplace_back(page, delta);
+}
+
+void
+Metrics::reset() {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  for (auto& counter : counters)
+    counter.store(0, std::memory_order_relaxed);
+  pageStart.fill(0);
+  pages.clear();
+}
+
+// Written atomically, the collector may read the file at any time
+bool
+Metrics::write(const fs::path& file) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  return writeFileAtomically(file, [](std::ostream& out) {
+    for (int id = 0; id < METRIC_COUNT; id++) {
+      const MetricInfo& info = METRICS[id];
+
+      out << "# HELP " << METRIC_PREFIX << info.name << "_total "
+          << info.help << '\n'
+          << "# TYPE " << METRIC_PREFIX << info.name << "_total counter\n"
+          << METRIC_PREFIX << info.name << "_total "
+          << value(static_cast<MetricId>(id)) << '\n';
+
+      if (!info.perPage or pages.empty())
+        continue;
+
+      out << "# HELP " << METRIC_PREFIX << "page_" << info.name << ' '
+          << info.help << ", by page\n"
+          << "# TYPE " << METRIC_PREFIX << "page_" << info.name
+          << " gauge\n";
+      for (const auto& page : pages)
+        out << METRIC_PREFIX << "page_" << info.name
+            << "{page=\"" << page.first << "\"} "
+            << page.second[id] << '\n';
+    }
+
+    out << "# HELP " << METRIC_PREFIX << "pages_total Pages written\n"
+        << "# TYPE " << METRIC_PREFIX << "pages_total counter\n"
+        << METRIC_PREFIX << "pages_total " << pages.size() << '\n';
+
+    return true;
+  });
+}
@@ -0,0 +1,182 @@
+#include "progress.h"
+#include "log.h"
+#include <iomanip>
+#include <sstream>
+#include <unistd.h>
+
+const static std::chrono::milliseconds REFRESH_INTERVAL { 100 };
+const static double MEGABYTE { 1024.0 * 1024.0 };
+
+std::mutex ProgressMeter::mutex;
+std::map<std::string, Throughput> ProgressMeter::totals;
+
+static bool
+isTerminal() {
+  static const bool terminal = ::isatty(STDOUT_FILENO);
+  return terminal;
+}
+
+static double
+seconds(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+
+static double
+perSecond(double amount, double seconds) {
+  return seconds > 0.0 ? amount / seconds : 0.0;
+}
+
+ProgressMeter::ProgressMeter(const std::string& name) :
+  name(name),
+  stats(),
+  pushedObjects(0),
+  pushTotal(0),
+  pushedBytes(0),
+  checkedOut(0),
+  checkoutTotal(0),
+  transferring(false),
+  checkingOut(false),
+  rendered(false),
+  finished(false),
+  started(Clock::now()),
+  transferEnd(started),
+  checkoutStart(started),
+  checkoutEnd(started),
+  lastRender()
+{ }
+
+void
+ProgressMeter::transfer(const ::git_indexer_progress* progress) {
+  stats = *progress;
+  transferring = true;
+  transferEnd = Clock::now();
+  render(false);
+}
+
+void
+ProgressMeter::push(unsigned int current, unsigned int total, size_t bytes) {
+  pushedObjects = current;
+  pushTotal = total;
+  pushedBytes = bytes;
+  transferring = true;
+  transferEnd = Clock::now();
+  render(false);
+}
+
+void
+ProgressMeter::checkout(size_t completed, size_t total) {
+  if (!checkingOut) {
+    checkingOut = true;
+    checkoutStart = Clock::now();
+  }
+  checkedOut = completed;
+  checkoutTotal = total;
+  checkoutEnd = Clock::now();
+  render(false);
+}
+
+void
+ProgressMeter::sideband(const char* str, int len) {
+  remoteMessage.assign(str, len);
+  while (!remoteMessage.empty() and
+         (remoteMessage.back() == '\n' or remoteMessage.back() == '\r'))
+    remoteMessage.pop_back();
+  render(false);
+}
+
+void
+ProgressMeter::render(bool force) {
+  if (!isTerminal() or !Log::enabled(LOG_INFO)) return;
+
+  Clock::time_point now { Clock::now() };
+  if (!force and now - lastRender < REFRESH_INTERVAL) return;
+  lastRender = now;
+
+  std::ostringstream line;
+  line << name << ": ";
+
+  if (pushTotal > 0)
+    line << "push " << (100 * pushedObjects / pushTotal) << "% ("
+         << pushedObjects << "/" << pushTotal << " objects, "
+         << std::fixed << std::setprecision(1)
+         << pushedBytes / MEGABYTE << " MiB)";
+  else if (stats.total_objects > 0) {
+    line << "net " << (100 * stats.received_objects / stats.total_objects)
+         << "% (" << stats.received_objects << "/" << stats.total_objects
+         << " objects, " << std::fixed << std::setprecision(1)
+         << stats.received_bytes / MEGABYTE << " MiB)";
+    if (stats.total_deltas > 0)
+      line << " deltas " << stats.indexed_deltas << "/"
+           << stats.total_deltas;
+  }
+  else if (!remoteMessage.empty())
+    line << "remote: " << remoteMessage;
+
+  if (checkoutTotal > 0)
+    line << " chk " << (100 * checkedOut / checkoutTotal) << "% ("
+         << checkedOut << "/" << checkoutTotal << ")";
+
+  // Queued with the other messages, so a line is never drawn inside one
+  Log::write(LOG_INFO, '\r' + line.str() + "\033[K");
+  rendered = true;
+}
+
+void
+ProgressMeter::finish() {
+  if (finished)
+    return;
+  finished = true;
+
+  if (rendered) {
+    render(true);
+    Log::write(LOG_INFO, "\n");
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  Throughput& total = totals[name];
+
+  if (transferring) {
+    total.objects += pushTotal > 0 ? pushedObjects : stats.received_objects;
+    total.bytes += pushTotal > 0 ? pushedBytes : stats.received_bytes;
+    total.transferSeconds += seconds(transferEnd - started);
+  }
+
+  if (checkingOut) {
+    total.files += checkedOut;
+    total.checkoutSeconds += seconds(checkoutEnd - checkoutStart);
+  }
+}
+
+void
+ProgressMeter::report(std::ostream& out) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  for (const auto& entry : totals) {
+    const Throughput& total = entry.second;
+
+    out << "Throughput " << entry.first << ":"
+        << std::fixed << std::setprecision(1);
+    if (total.objects > 0)
+      out << " " << total.objects << " objects, "
+          << total.bytes / MEGABYTE << " MiB in "
+          << total.transferSeconds << " s ("
+          << perSecond(total.objects, total.transferSeconds)
+          << " objects/s, "
+          << perSecond(total.bytes / MEGABYTE, total.transferSeconds)
+          << " MiB/s)";
+    if (total.objects > 0 and total.files > 0)
+      out << ";";
+    if (total.files > 0)
+      out << " " << total.files << " files checked out in "
+          << total.checkoutSeconds << " s ("
+          << perSecond(total.files, total.checkoutSeconds)
+          << " files/s)";
+    out << std::defaultfloat << std::endl;
+  }
+}
+
+void
+ProgressMeter::reset() {
+  std::lock_guard<std::mutex> lock(mutex);
+  totals.clear();
+}
@@ -0,0 +1,79 @@
+#include "statcache.h"
+#include <ctime>
+
+static bool
+statFile(const fs::path& file,
+         FileStat& fileStat) {
+  struct stat st;
+  if (::stat(file.c_str(), &st) != 0)
+    return false;
+
+  fileStat.size = st.st_size;
+  fileStat.mtime = st.st_mtim;
+  fileStat.ctime = st.st_ctim;
+  fileStat.ino = st.st_ino;
+  fileStat.dev = st.st_dev;
+  return true;
+}
+
+static bool
+sameTime(const struct timespec& a,
+         const struct timespec& b) {
+  return a.tv_sec == b.tv_sec and a.tv_nsec == b.tv_nsec;
+}
+
+static bool
+sameStat(const FileStat& a,
+         const FileStat& b) {
+  return a.size == b.size and
+    sameTime(a.mtime, b.mtime) and
+    sameTime(a.ctime, b.ctime) and
+    a.ino == b.ino and
+    a.dev == b.dev;
+}
+
+// Timestamps only have whole-second precision on some file systems
+static bool
+isRacy(const FileStat& fileStat,
+       std::time_t now) {
+  return fileStat.mtime.tv_sec >= now or fileStat.ctime.tv_sec >= now;
+}
+
+std::string
+StatCache::key(const fs::path& srcFile,
+               const fs::path& dstFile) {
+  std::string k { srcFile.native() };
+  k += '\0';
+  k += dstFile.native();
+  return k;
+}
+
+bool
+StatCache::unchanged(const fs::path& srcFile,
+                     const fs::path& dstFile) const {
+  auto entry = entries.find(key(srcFile, dstFile));
+  if (entry == entries.end() or entry->second.racy)
+    return false;
+
+  FileStat src, dst;
+  if (!statFile(srcFile, src) or !statFile(dstFile, dst))
+    return false;
+
+  if (!sameStat(src, entry->second.src) or !sameStat(dst, entry->second.dst))
+    return false;
+
+  nHits.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void
+StatCache::store(const fs::path& srcFile,
+                 const fs::path& dstFile) {
+  Entry entry;
+  if (!statFile(srcFile, entry.src) or !statFile(dstFile, entry.dst))
+    return;
+
+  std::time_t now = std::time(nullptr);
+  entry.racy = isRacy(entry.src, now) or isRacy(entry.dst, now);
+  entries[key(srcFile, dstFile)] = entry;
+}
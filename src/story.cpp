@@ -0,0 +1,856 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <string>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <set>
+#include <algorithm>
+#include <thread>
+#include <git2.h>
+#include "helper.h"
+#include "pipeline.h"
+#include "fastimport.h"
+#include "bundle.h"
+#include "checkpoint.h"
+#include "storyparts.h"
+#include "metrics.h"
+#include "progress.h"
+#include "archive.h"
+#include "assets.h"
+
+const std::string ORIGIN     { "ORIGIN" };
+const char* READMEFILENAME   { "README.md" };
+const char* STORYFILENAME    { "story.md" };
+const char* DOTSTORYFILENAME { ".story.md" };
+const char* IGNOREFILENAME   { ".md2csignore" };
+const char* TARGETDIR        { "target" };
+const char* REPOSITORIESDIR  { "repositories" };
+const char* REPOSITORYDIR    { "repository" };
+const char* WORKTREESDIR     { "worktrees" };
+const char* CACHEDIR         { "cache" };
+const char* ASSETSMANIFEST   { "assets" };
+const char* STDOUTFILENAME   { "-" };
+const char* WORKTREEPREFIX   { "md2cs-page-" };
+const char* DEFAULTBRANCH    { "main" };
+const char* STARTXMLCOMMENT  { "<!--" };
+const size_t PARSEDPAGESQUEUESIZE { 16 };
+const size_t READYPAGESQUEUESIZE  { 2 };
+
+inline const char* getOutputFilename(bool);
+
+// Stage 1: hands out the pages of story.md and the files it includes,
+// numbered in story order. The files are already parsed and escaped.
+static void
+parseStoryPages(const StoryParts& storyParts,
+                BoundedQueue<StoryPage>& parsedPages,
+                Options& options) {
+  storyParts.pages(parsedPages, options);
+}
+
+// Turns the prefixes of a paths: key into repository relative paths.
+// "." or "/" selects the whole tree again, which is an empty list.
+static std::vector<std::string>
+normalizePathPrefixes(const std::vector<std::string>& prefixes) {
+  std::vector<std::string> result;
+
+  for (const auto& prefix : prefixes) {
+    fs::path path { fs::path(prefix).lexically_normal().relative_path() };
+    std::string normal { path.generic_string() };
+
+    while (!normal.empty() and normal.back() == '/')
+      normal.pop_back();
+
+    if (normal.empty() or normal == ".")
+      return std::vector<std::string>();
+
+    result.push_back(normal);
+  }
+
+  return result;
+}
+
+// The last page that checks out each source repository
+typedef std::map<std::string, int> LastPages;
+
+// Local repositories may be given relative to story.md, but clones and
+// remotes are created from the target directories
+static std::string
+absoluteRepoURL(const std::string& url,
+                const RepoDesc* rd,
+                const fs::path& storyDir) {
+  if (!rd or rd->protocol != FILE_PROTOCOL or
+      url.find("://") != std::string::npos)
+    return url;
+
+  return (storyDir / url).lexically_normal().string();
+}
+
+// Preflight: clones every source repository the story uses and resolves
+// each tag: and branch: to a commit before any page is committed. All
+// the refs that cannot be resolved are reported at once. On --resume the
+// clones are reopened, and the refs of the checkpoint are kept.
+static bool
+preflightStory(const StoryParts& storyParts,
+               const fs::path& storyDir,
+               const fs::path& targetReposPath,
+               std::map<std::string, std::unique_ptr<RepoDesc>>& extRepos,
+               ResolvedRefs& resolvedRefs,
+               LastPages& lastPages,
+               Options& options) {
+  struct WantedRef {
+    RepoDesc* rd;
+    std::string name;
+    int page;
+  };
+
+  BoundedQueue<StoryPage> pages(PARSEDPAGESQUEUESIZE);
+  std::thread parser(parseStoryPages,
+                     std::cref(storyParts),
+                     std::ref(pages),
+                     std::ref(options));
+
+  std::vector<std::string> errors;
+  std::vector<WantedRef> wanted;
+  std::map<std::string, std::string> urlOfName;
+  std::set<std::string> collisions;
+  RepoDesc *currRepo = nullptr;
+  bool currCollides = false;
+  StoryPage page;
+
+  while (pages.pop(page)) {
+    for (auto& url : page.repositories) {
+      currCollides = collisions.count(url) > 0;
+      if (currCollides) {
+        currRepo = nullptr;
+        continue;
+      }
+
+      auto known = extRepos.find(url);
+      if (known != extRepos.end()) {
+        currRepo = known->second.get();
+        continue;
+      }
+
+      std::unique_ptr<RepoDesc> rd { url2RepoDesc(url) };
+      currRepo = rd.get();
+
+      if (!rd) {
+        errors.push_back("page " + std::to_string(page.number) +
+                         ": incorrect repository url " + url);
+        continue;
+      }
+
+      LogLine(LOG_DEBUG, "Repository")
+        .field("protocol", rd->protocol)
+        .field("host", rd->host)
+        .field("user", rd->user)
+        .field("name", rd->repoName);
+
+      // The clone, its worktrees and its refs are all keyed by the name
+      auto taken = urlOfName.emplace(rd->repoName, url);
+      if (!taken.second) {
+        errors.push_back("page " + std::to_string(page.number) +
+                         ": repository " + url + " has the same name as " +
+                         taken.first->second);
+        collisions.insert(url);
+        currCollides = true;
+        currRepo = nullptr;
+        continue;
+      }
+
+      rd->repoDir = targetReposPath / rd->repoName;
+      rd->checkoutName = DEFAULTBRANCH;
+      rd->checkoutType = BRANCH;
+
+      if (options.resume and fs::exists(rd->repoDir)) {
+        m_giterror(::git_repository_open(outPtr(rd->repo),
+                                         rd->repoDir.c_str()),
+                   "Cannot open the clone of a previous build",
+                   options);
+        extRepos[url] = std::move(rd);
+        continue;
+      }
+
+      // Pages are checked out into worktrees, the clone itself needs none
+      std::string cloneURL { absoluteRepoURL(url, rd.get(), storyDir) };
+      m_giterror(cloneGitRepo(rd->repoDir,
+                              cloneURL,
+                              rd.get(),
+                              options,
+                              false),
+                 "Clone failed",
+                 options);
+
+      extRepos[url] = std::move(rd);
+    }
+
+    // The writer clones origin halfway through the story, a bad url has
+    // to be found before the first page is committed
+    if (options.upload and !page.origin.empty() and
+        !std::unique_ptr<RepoDesc>(url2RepoDesc(page.origin)))
+      errors.push_back("page " + std::to_string(page.number) +
+                       ": incorrect origin url " + page.origin);
+
+    // Asset directories sit in the story project, away from target/
+    for (const auto& dir : page.assets) {
+      fs::path assetDir { fs::path(dir).lexically_normal() };
+      std::string top { assetDir.begin()->string() };
+
+      if (assetDir.is_absolute() or top == "." or top == ".." or
+          top == TARGETDIR or top == ".git" or
+          !fs::is_directory(storyDir / assetDir))
+        errors.push_back("page " + std::to_string(page.number) +
+                         ": " + dir +
+                         " is not a directory of the story project");
+    }
+
+    if (!page.checkoutName.empty()) {
+      if (currRepo)
+        wanted.push_back({ currRepo, page.checkoutName, page.number });
+      else if (!currCollides)
+        errors.push_back("page " + std::to_string(page.number) +
+                         ": " + page.checkoutName +
+                         " without a repository");
+    }
+  }
+
+  parser.join();
+
+  std::map<RepoDesc*, RefIndex> refIndexes;
+
+  for (const auto& ref : wanted) {
+    lastPages[ref.rd->repoName] = ref.page;
+
+    auto key = std::make_pair(ref.rd->repoName, ref.name);
+    if (resolvedRefs.count(key)) continue;
+
+    auto index = refIndexes.find(ref.rd);
+    if (index == refIndexes.end()) {
+      index = refIndexes.emplace(ref.rd, RefIndex()).first;
+      m_giterror(index->second.build(ref.rd->repo.get()),
+                 "Cannot list references",
+                 options);
+    }
+
+    ::git_oid oid;
+    if (index->second.resolve(ref.name, &oid))
+      resolvedRefs[key] = oid;
+    else
+      errors.push_back("page " + std::to_string(ref.page) +
+                       ": cannot resolve " + ref.name +
+                       " in " + ref.rd->repoName);
+  }
+
+  for (const auto& error : errors)
+    LogLine(LOG_ERROR, error);
+
+  if (!errors.empty())
+    LogLine(LOG_ERROR, "Errors found before processing the story")
+      .field("count", errors.size());
+
+  return errors.empty();
+}
+
+// Stage 2: checks out each page's branch or tag into a worktree of its
+// repository, up to lookahead pages ahead of the writer. Repositories are
+// already cloned and refs resolved by the preflight. A paths: key stays
+// in effect for the following pages until another one replaces it.
+// Pages a resumed build already committed are passed on without a tree.
+// After the last page of a repository its clone is closed, and the
+// writer closes its worktrees once that page is committed. A failed
+// checkout is handed to the writer, which ends the build: this thread
+// must not remove target/ under it.
+static void
+materializeSourceTrees(BoundedQueue<StoryPage>& parsedPages,
+                       BoundedQueue<StoryPage>& readyPages,
+                       std::map<std::string,
+                                std::unique_ptr<SourceTreePool>>& pools,
+                       std::map<std::string, std::unique_ptr<RepoDesc>>& extRepos,
+                       const ResolvedRefs& resolvedRefs,
+                       const LastPages& lastPages,
+                       Options& options) {
+  RepoDesc *rd = nullptr;
+  std::vector<std::string> currPaths;
+  StoryPage page;
+
+  while (parsedPages.pop(page)) {
+    if (!page.paths.empty())
+      currPaths = normalizePathPrefixes(page.paths);
+    page.paths = currPaths;
+
+    for (auto& url : page.repositories)
+      rd = extRepos[url].get();
+
+    if (!page.checkoutName.empty() and page.number > options.resumePage) {
+      LogLine(LOG_INFO, "Checkout")
+        .field(page.checkoutType == BRANCH ? "branch" : "tag",
+               page.checkoutName)
+        .field("repository", rd->repoName)
+        .field("page", page.number);
+
+      auto& repoPool = pools[rd->repoName];
+      if (!repoPool)
+        repoPool.reset(new SourceTreePool(options.lookahead));
+
+      SourceTreePool *pool = repoPool.get();
+      SourceTree *tree = pool->acquire();
+
+      if (!tree) {
+        std::string name { WORKTREEPREFIX + std::to_string(pool->size()) };
+        fs::path dir { options.targetPath / WORKTREESDIR /
+                       rd->repoName / name };
+        RepositoryPtr worktreeRepo;
+        int error = addWorktree(worktreeRepo, rd->repo.get(), name, dir);
+
+        if (error < GIT_OK) {
+          page.failure = GitFailure(error, "Worktree " + dir.string() +
+                                    " cannot be added");
+          readyPages.push(std::move(page));
+          break;
+        }
+
+        tree = pool->own(std::unique_ptr<SourceTree>(
+                           new SourceTree(dir, std::move(worktreeRepo))));
+      }
+
+      std::vector<std::string> pathspecs { currPaths };
+      if (!pathspecs.empty())
+        pathspecs.push_back(IGNOREFILENAME);
+
+      int error = checkoutWorktree(tree->repo.get(),
+                                   resolvedRefs.at(std::make_pair(rd->repoName,
+                                                                  page.checkoutName)),
+                                   rd->repoName,
+                                   options,
+                                   pathspecs);
+
+      if (error < GIT_OK) {
+        page.failure = GitFailure(error, "Checkout failed");
+        readyPages.push(std::move(page));
+        break;
+      }
+
+      page.source = tree;
+      page.sourcePool = pool;
+      page.lastOfSource = page.number == lastPages.at(rd->repoName);
+
+      if (page.lastOfSource)
+        rd->repo.reset();
+    }
+
+    readyPages.push(std::move(page));
+  }
+
+  // After a failure the parser may still be pushing pages
+  while (parsedPages.pop(page))
+    ;
+
+  readyPages.close();
+}
+
+static const char*
+lastGitErrorMessage() {
+  const ::git_error* error = ::git_error_last();
+  return error ? error->message : "no detailed info";
+}
+
+// With "-" the export owns stdout, and messages are sent to stderr instead
+static std::streambuf* stdoutBuffer { std::cout.rdbuf() };
+
+static bool
+emitStoryExport(const std::string& fileName,
+                const char* description,
+                const std::function<int(std::ostream&)>& write) {
+  int error;
+
+  if (fileName == STDOUTFILENAME) {
+    std::ostream out(stdoutBuffer);
+    error = write(out);
+  }
+  else {
+    std::ofstream out(fileName, std::ios::binary);
+    error = out ? write(out) : -1;
+  }
+
+  // The story itself is complete, only the export is missing
+  if (error < 0) {
+    LogLine(LOG_ERROR, std::string("Cannot write ") + description)
+      .field("file", fileName);
+    return false;
+  }
+
+  return true;
+}
+
+// On --resume the story repository of the failed build is reopened and
+// brought back to the checkpoint, dropping whatever the failed page left.
+// The blobs of earlier pages are still read from the sources in place.
+static RepositoryPtr
+reopenStoryRepository(const fs::path& targetRepoPath,
+                      const std::map<std::string,
+                                     std::unique_ptr<RepoDesc>>& extRepos,
+                      const Checkpoint& checkpoint,
+                      Options& options) {
+  RepositoryPtr repo;
+  CommitPtr commit;
+
+  m_giterror(::git_repository_open(outPtr(repo), targetRepoPath.c_str()),
+             "Cannot open the story repository",
+             options);
+
+  for (const auto& ext : extRepos)
+    addObjectAlternate(repo.get(), ext.second->repo.get(), options);
+
+  m_giterror(::git_commit_lookup(outPtr(commit),
+                                 repo.get(),
+                                 &checkpoint.commit),
+             "Cannot find the commit of the checkpoint",
+             options);
+  resetUntilFirstCommit(repo.get(), commit.get(), options);
+
+  return repo;
+}
+
+static void
+pushStoryBranch(::git_repository* repo,
+                bool force,
+                Options& options) {
+  LogLine(LOG_INFO, "Pushing the story").field("force", force);
+  m_giterror(pushGitRepo(repo,
+                         options,
+                         "refs/heads/main",
+                         force),
+             "Error pushing", options);
+}
+
+// Stage 3: owns the story repository. Copies each page's source tree,
+// writes the page file and commits, strictly in story order. A checkpoint
+// is saved after every commit. Returns false when an export is missing.
+static bool
+writeStoryPages(BoundedQueue<StoryPage>& readyPages,
+                const fs::path& storyDir,
+                const fs::path& targetRepoPath,
+                RepositoryPtr repo,
+                Checkpoint& checkpoint,
+                Options& options) {
+  CommitPtr firstCommit;
+  bool isFirstCommit = !repo;
+  bool forcePush = checkpoint.forcePush;
+  int pagesProcessed = 0;
+  int commitDone = 0;
+
+  IgnoreRules storyIgnoreRules;
+  storyIgnoreRules.load(storyDir / IGNOREFILENAME);
+  StatCache statCache;
+  CompareEngine compareEngine(options.ioThreads);
+  std::unique_ptr<ArchiveExporter> archives;
+  AssetSync assets(storyDir, options.targetPath / CACHEDIR / ASSETSMANIFEST);
+  std::vector<std::string> assetDirs;
+  std::unique_ptr<DiffIndex> diffIndex;
+  // The first page is committed with the second one
+  ChangeList changes;
+
+  if (!options.archivesDir.empty())
+    archives.reset(new ArchiveExporter(options.archivesDir,
+                                       options.ioThreads));
+
+  if (!options.diffIndexFile.empty()) {
+    diffIndex.reset(new DiffIndex(options.ioThreads));
+
+    // The pages before the checkpoint are not diffed again
+    if (options.resumePage and
+        !diffIndex->load(options.diffIndexFile, options.resumePage))
+      LogLine(LOG_WARNING, "The diff index of the previous run is damaged,"
+              " the pages from the damage on are left out")
+        .field("file", options.diffIndexFile);
+  }
+
+  StoryPage page;
+
+  while (readyPages.pop(page)) {
+    // The checkout of this page failed on the materializer
+    m_giterror(page.failure, options);
+
+    assetDirs.insert(assetDirs.end(), page.assets.begin(), page.assets.end());
+
+    if (page.number <= options.resumePage) {
+      // Committed before the checkpoint, only the push may be missing
+      if (page.isLast && options.upload)
+        pushStoryBranch(repo.get(), forcePush, options);
+      continue;
+    }
+
+    if (!page.origin.empty()) {
+      RemotePtr remote;
+      std::string url { page.origin };
+
+      if (options.upload) {
+        std::unique_ptr<RepoDesc> rd { url2RepoDesc(url) };
+
+        if (!rd) {
+          LogLine(LOG_ERROR, "Cannot create a repository description for"
+                  " \"origin\"")
+            .field("url", url);
+
+          ::exit(EXIT_FAILURE);
+        }
+
+        LogLine(LOG_DEBUG, "Repository")
+          .field("protocol", rd->protocol)
+          .field("host", rd->host)
+          .field("user", rd->user)
+          .field("name", rd->repoName);
+
+        rd->repoDir = targetRepoPath;
+        rd->checkoutName = DEFAULTBRANCH;
+
+        fs::path originPath { targetRepoPath };
+        std::string cloneURL { absoluteRepoURL(url, rd.get(), storyDir) };
+        m_giterror(cloneGitRepo(originPath,
+                                cloneURL,
+                                rd.get(),
+                                options),
+                   "Creating local repository of \"origin\"",
+                   options);
+
+        repo = std::move(rd->repo);
+
+        firstCommit = getFirstCommitOid(repo.get(),
+                                        options);
+
+        if (firstCommit) {
+          resetUntilFirstCommit(repo.get(), firstCommit.get(), options);
+        }
+        forcePush = firstCommit ? true : false;
+      }
+      else {
+        fs::path originPath { targetRepoPath };
+        std::unique_ptr<RepoDesc> rd { url2RepoDesc(url) };
+        std::string remoteURL { absoluteRepoURL(url, rd.get(), storyDir) };
+        repo = initLocalRepository(originPath, options);
+        m_giterror(::git_remote_create(outPtr(remote),
+                                       repo.get(),
+                                       "origin",
+                                       remoteURL.c_str()),
+                   "Creating remote entry",
+                   options);
+      }
+    }
+
+    if (page.source) {
+      addObjectAlternate(repo.get(), page.source->repo.get(), options);
+
+      IgnoreRules ignoreRules { storyIgnoreRules };
+      ignoreRules.load(page.source->dir / IGNOREFILENAME);
+      ignoreRules.limitTo(page.paths);
+      // The asset directories belong to the story project, not the source
+      for (const auto& dir : assetDirs)
+        ignoreRules.protect(dir);
+
+      diffDirAction(repo.get(),
+                    page.source->dir,
+                    targetRepoPath,
+                    ignoreRules,
+                    statCache,
+                    compareEngine,
+                    changes,
+                    options, true);
+
+      page.sourcePool->release(page.source);
+
+      if (page.lastOfSource)
+        page.sourcePool->close();
+    }
+
+    for (const auto& dir : page.assets)
+      m_giterror(assets.sync(repo.get(), dir, changes),
+                 "Cannot synchronize the assets of the page",
+                 options);
+
+    std::ostringstream buffer(page.content);
+    bool firstPage = page.number == 1;
+
+    pagesProcessed++;
+    addBuffer2GitRepo(repo.get(),
+                      &buffer,
+                      getOutputFilename(firstPage),
+                      options);
+
+    if (!firstPage) {
+      commitDone++;
+
+      if (firstCommit && isFirstCommit && options.upload) {
+        commitAmendGitRepo(repo.get(),
+                           page.message,
+                           firstCommit.get(),
+                           options,
+                           page.number);
+      }
+      else {
+        commitGitRepo(repo.get(),
+                      page.message,
+                      options,
+                      page.number);
+      }
+
+      isFirstCommit = false;
+
+      checkpoint.page = page.number;
+      checkpoint.forcePush = forcePush;
+      m_giterror(::git_reference_name_to_id(&checkpoint.commit,
+                                            repo.get(),
+                                            "HEAD"),
+                 "Cannot read the commit of the page",
+                 options);
+
+      if (!checkpoint.save(options.targetPath))
+        LogLine(LOG_WARNING, "Cannot save the checkpoint")
+          .field("page", page.number);
+
+      if (archives)
+        m_giterror(archives->add(repo.get(), page.number, checkpoint.commit),
+                   "Cannot archive the tree of the page",
+                   options);
+
+      if (diffIndex)
+        m_giterror(diffIndex->add(repo.get(),
+                                  page.number,
+                                  checkpoint.commit,
+                                  changes),
+                   "Cannot index the changes of the page",
+                   options);
+      changes.clear();
+    }
+
+    if (page.isLast && options.upload)
+      pushStoryBranch(repo.get(), forcePush, options);
+
+    Metrics::endPage(page.number);
+  }
+
+  options.statCacheHits = statCache.hits();
+
+  if (!assetDirs.empty()) {
+    LogLine(LOG_INFO, "Assets synchronized")
+      .field("unchanged", assets.unchanged());
+
+    if (!assets.save())
+      LogLine(LOG_WARNING, "Cannot save the asset manifest");
+  }
+
+  if (diffIndex and !diffIndex->write(options.diffIndexFile))
+    LogLine(LOG_WARNING, "Cannot write the diff index")
+      .field("file", options.diffIndexFile);
+
+  if (archives and !archives->finish())
+    LogLine(LOG_WARNING, "Cannot write every page archive")
+      .field("dir", options.archivesDir);
+
+  if (repo) {
+    packReachableObjects(repo.get(), "refs/heads/main", options);
+
+    // Both only speed up readers of the story, it is complete without them
+    if (writeCommitGraph(repo.get(), "refs/heads/main") < 0)
+      LogLine(LOG_WARNING, "Cannot write the commit-graph")
+        .field("reason", lastGitErrorMessage());
+
+    if (options.multiPackIndex and
+        writeMultiPackIndex(repo.get()) < 0)
+      LogLine(LOG_WARNING, "Cannot write the multi-pack-index")
+        .field("reason", lastGitErrorMessage());
+  }
+
+  bool exported = true;
+
+  if (repo and !options.fastImportFile.empty()) {
+    exported = emitStoryExport(options.fastImportFile,
+                               "fast-import stream",
+                               [&](std::ostream& out) {
+                                 return writeFastImport(repo.get(),
+                                                        "refs/heads/main",
+                                                        out,
+                                                        options);
+                               });
+  }
+
+  if (exported and repo and !options.bundleFile.empty()) {
+    exported = emitStoryExport(options.bundleFile,
+                               "bundle",
+                               [&](std::ostream& out) {
+                                 return writeBundle(repo.get(),
+                                                    "refs/heads/main",
+                                                    options.bundleBasis,
+                                                    out,
+                                                    options);
+                               });
+  }
+
+  if (!options.metricsFile.empty() and
+      !Metrics::write(options.metricsFile))
+    LogLine(LOG_WARNING, "Cannot write metrics")
+      .field("file", options.metricsFile);
+
+  stopProcessing(pagesProcessed,
+                 commitDone,
+                 options);
+
+  return exported;
+}
+
+// Builds the story of storyDir with libgit2 already initialized. Every
+// repository handle is released when it returns.
+static int
+buildStory(const fs::path& storyDir, Options& options) {
+  fs::path storyFile { storyDir / STORYFILENAME };
+
+  if (!fs::exists(storyFile)) {
+    LogLine(LOG_ERROR, "Story file doesn't exist").field("file", storyFile);
+    return EXIT_FAILURE;
+  }
+
+  fs::path targetReposPath { options.targetPath /
+                             REPOSITORIESDIR };
+  fs::path targetRepoPath { options.targetPath /
+                            REPOSITORYDIR };
+
+  if (options.maxMemory)
+    limitGitMemory(options.maxMemory, options);
+
+  // Counters are static, every build reports only its own
+  Metrics::reset();
+  ProgressMeter::reset();
+
+  // Parsed story files are kept in target/cache from one build to the next
+  StoryParts storyParts;
+
+  if (!storyParts.load(storyFile, options.targetPath / CACHEDIR))
+    return EXIT_FAILURE;
+
+  LogLine(LOG_INFO, "Story files")
+    .field("files", storyParts.size())
+    .field("unchanged", storyParts.cachedParts());
+
+  Checkpoint checkpoint;
+  checkpoint.storyDigest = storyParts.digest();
+
+  if (options.resume) {
+    Checkpoint last;
+
+    if (!last.load(options.targetPath)) {
+      LogLine(LOG_INFO, "No checkpoint, the story is built from the start")
+        .field("target", options.targetPath);
+      options.resume = false;
+    }
+    else if (last.storyDigest != checkpoint.storyDigest) {
+      LogLine(LOG_ERROR, "The story or the files it includes have changed"
+              " since the checkpoint, run without --resume")
+        .field("file", storyFile);
+      return EXIT_FAILURE;
+    }
+    else {
+      LogLine(LOG_INFO, "Resuming").field("after_page", last.page);
+      checkpoint = last;
+      options.resumePage = last.page;
+    }
+  }
+
+  if (!options.resume) {
+    for (const auto& entry : fs::directory_iterator(options.targetPath))
+      if (entry.path().filename() != CACHEDIR)
+        fs::remove_all(entry.path());
+  }
+
+  fs::create_directory(options.targetPath);
+  fs::create_directory(targetReposPath);
+  fs::create_directory(targetRepoPath);
+
+  // Only the writer depends on the working directory, every other
+  // stage uses absolute paths
+  fs::current_path(targetRepoPath);
+
+  LogLine(LOG_INFO, "Processing")
+    .field("story", storyFile)
+    .field("working_dir", fs::current_path());
+
+  BoundedQueue<StoryPage> parsedPages(PARSEDPAGESQUEUESIZE);
+  BoundedQueue<StoryPage> readyPages(std::max<size_t>(READYPAGESQUEUESIZE,
+                                                      options.lookahead));
+  std::map<std::string, std::unique_ptr<SourceTreePool>> pools;
+  std::map<std::string, std::unique_ptr<RepoDesc>> extRepos;
+  ResolvedRefs resolvedRefs { checkpoint.refs };
+  LastPages lastPages;
+
+  if (!preflightStory(storyParts,
+                      storyDir,
+                      targetReposPath,
+                      extRepos,
+                      resolvedRefs,
+                      lastPages,
+                      options)) {
+    if (!options.debug and !hasCheckpoint(options.targetPath))
+      fs::remove_all(options.targetPath);
+
+    return EXIT_FAILURE;
+  }
+
+  checkpoint.refs = resolvedRefs;
+
+  RepositoryPtr storyRepo;
+  if (options.resume)
+    storyRepo = reopenStoryRepository(targetRepoPath,
+                                      extRepos,
+                                      checkpoint,
+                                      options);
+
+  std::thread parser(parseStoryPages,
+                     std::cref(storyParts),
+                     std::ref(parsedPages),
+                     std::ref(options));
+  std::thread materializer(materializeSourceTrees,
+                           std::ref(parsedPages),
+                           std::ref(readyPages),
+                           std::ref(pools),
+                           std::ref(extRepos),
+                           std::cref(resolvedRefs),
+                           std::cref(lastPages),
+                           std::ref(options));
+
+  bool written = writeStoryPages(readyPages,
+                                 storyDir,
+                                 targetRepoPath,
+                                 std::move(storyRepo),
+                                 checkpoint,
+                                 options);
+
+  parser.join();
+  materializer.join();
+
+  return written ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int
+processStoryFile(const fs::path& storyDir, Options& options) {
+  fs::path workingDir { fs::current_path() };
+
+  options.targetPath = storyDir / TARGETDIR;
+
+  m_giterror(::git_libgit2_init(),
+             "Cannot initialize libgit2",
+             options);
+
+  int status = buildStory(storyDir, options);
+
+  // The pools and clones of buildStory are gone, libgit2 can be shut down
+  fs::current_path(workingDir);
+  shutdownGitLibrary(options);
+
+  return status;
+}
+
+inline const char* getOutputFilename(bool isReadme) {
+  return isReadme ? READMEFILENAME :
+   DOTSTORYFILENAME;
+}
@@ -0,0 +1,523 @@
+#include "storyparts.h"
+#include "atomicfile.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <regex>
+#include <set>
+#include <sstream>
+#include <thread>
+
+const static char* CACHE_VERSION { "md2cs-part 2" };
+
+// FNV-1a, stable from one run to the next unlike std::hash
+std::string
+contentDigest(const std::string& content) {
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (char c : content) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ULL;
+  }
+
+  std::ostringstream digest;
+  digest << std::hex << std::setw(16) << std::setfill('0') << hash;
+  return digest.str();
+}
+
+// Part files, and the temporaries they are written through, are named
+// after a digest; anything else in the cache directory is not theirs
+static bool
+isPartFile(const std::string& name) {
+  return name.size() >= 16 and
+    std::all_of(name.begin(), name.begin() + 16,
+                [](char c) { return std::isdigit(c) or (c >= 'a' and c <= 'f'); }) and
+    (name.size() == 16 or name[16] == '.');
+}
+
+// Included files are named relative to the file that includes them
+static fs::path
+includedFile(const fs::path& from, const std::string& name) {
+  return fs::weakly_canonical(from.parent_path() / name);
+}
+
+// Splits one file into chunks, with the same rules story.md always had:
+// a line of three or more - or = opens a header and the next one closes
+// it. Headers of several pages may come from different files, so chunks
+// are only joined into pages by StoryParts::pages(). The line getline
+// leaves behind at the end is returned in tail.
+static std::vector<PartChunk>
+parseChunks(std::istream& input, std::string& tail) {
+  std::string line;
+
+  enum FILEPROCESS { INCONFIG, OUTCONFIG };
+  FILEPROCESS state = OUTCONFIG;
+  std::vector<PartChunk> chunks;
+  std::ostringstream buffer;
+  PartChunk chunk;
+  const std::regex line_regex("^(-|=){3}(-|=)* *$");
+  const std::regex cfg_regex("(^.*): +(.*)");
+  const std::regex title_regex("^### +(.*)");
+  const std::regex list_regex("[,;]");
+  const std::regex include_regex("^ *<!-- *include: *(.*[^ ]) *--> *$");
+
+  auto flush = [&]() {
+    chunk.content = buffer.str();
+    if (chunk.startsPage or !chunk.content.empty() or chunk.hasTitle)
+      chunks.push_back(std::move(chunk));
+    chunk = PartChunk();
+    buffer.str("");
+  };
+
+  while (std::getline(input, line)) {
+    if (std::regex_match(line, line_regex)) {
+      switch (state) {
+      case INCONFIG:
+        state = OUTCONFIG;
+        buffer << transTex2HTMLEntity(line) << std::endl;
+        break;
+      case OUTCONFIG:
+        state = INCONFIG;
+        flush();
+        chunk.startsPage = true;
+        chunk.opening = transTex2HTMLEntity(line) + "\n";
+        break;
+      }
+    }
+    else {
+      switch (state) {
+      case INCONFIG:
+        {
+          std::smatch cfg;
+
+          if (std::regex_match(line, cfg, cfg_regex)) {
+
+            if (cfg[1] == "repository")
+              chunk.repositories.push_back(cfg[2]);
+
+            if (cfg[1] == "branch") {
+              chunk.hasCheckout = true;
+              chunk.checkoutType = BRANCH;
+              chunk.checkoutName = cfg[2];
+            }
+
+            if (cfg[1] == "tag") {
+              chunk.hasCheckout = true;
+              chunk.checkoutType = TAG;
+              chunk.checkoutName = cfg[2];
+            }
+
+            if (cfg[1] == "focus")
+              buffer << transTex2HTMLEntity(line) << std::endl;
+
+            if (cfg[1] == "paths") {
+              std::istringstream prefixes { std::regex_replace(cfg[2].str(),
+                                                               list_regex,
+                                                               " ") };
+              std::string prefix;
+              while (prefixes >> prefix)
+                chunk.paths.push_back(prefix);
+            }
+
+            if (cfg[1] == "assets") {
+              std::istringstream dirs { std::regex_replace(cfg[2].str(),
+                                                           list_regex,
+                                                           " ") };
+              std::string dir;
+              while (dirs >> dir) {
+                while (dir.size() > 1 and dir.back() == '/')
+                  dir.pop_back();
+                chunk.assets.push_back(dir);
+              }
+            }
+
+            if (cfg[1] == "origin")
+              chunk.origin = cfg[2];
+          }
+        }
+        break;
+      case OUTCONFIG:
+        {
+          std::smatch cfg;
+
+          if (std::regex_match(line, cfg, include_regex)) {
+            flush();
+            chunk.include = cfg[1];
+            chunks.push_back(std::move(chunk));
+            chunk = PartChunk();
+            break;
+          }
+
+          if (std::regex_match(line, cfg, title_regex)) {
+            chunk.hasTitle = true;
+            chunk.title = cfg[1];
+          }
+
+          buffer << transTex2HTMLEntity(line) << std::endl;
+        }
+        break;
+      }
+    }
+  }
+
+  flush();
+  tail = transTex2HTMLEntity(line);
+  return chunks;
+}
+
+static void
+writeField(std::ostream& out, const std::string& field) {
+  out << field.size() << ' ' << field << '\n';
+}
+
+// What is left of the cache file bounds every size read from it, so a
+// damaged entry is a miss rather than a huge allocation
+static size_t
+bytesLeft(std::istream& in) {
+  std::streampos here = in.tellg();
+  if (here < 0)
+    return 0;
+
+  in.seekg(0, std::ios::end);
+  std::streampos end = in.tellg();
+  in.seekg(here);
+
+  return end > here ? static_cast<size_t>(end - here) : 0;
+}
+
+static bool
+readField(std::istream& in, std::string& field) {
+  size_t size;
+
+  if (!(in >> size) or in.get() != ' ' or size > bytesLeft(in))
+    return false;
+
+  field.assign(size, '\0');
+  in.read(&field[0], size);
+  return in.get() == '\n';
+}
+
+static void
+writeList(std::ostream& out, const std::vector<std::string>& list) {
+  out << list.size() << '\n';
+  for (const auto& field : list)
+    writeField(out, field);
+}
+
+static bool
+readList(std::istream& in, std::vector<std::string>& list) {
+  size_t size;
+
+  if (!(in >> size) or in.get() != '\n' or size > bytesLeft(in))
+    return false;
+
+  list.resize(size);
+  for (auto& field : list)
+    if (!readField(in, field)) return false;
+
+  return true;
+}
+
+static bool
+readCache(const fs::path& cacheFile,
+          std::vector<PartChunk>& chunks,
+          std::string& tail) {
+  std::ifstream in(cacheFile, std::ios::binary);
+  std::string line;
+
+  if (!std::getline(in, line) or line != CACHE_VERSION)
+    return false;
+
+  std::string tag;
+  while (in >> tag and tag == "chunk") {
+    PartChunk chunk;
+    int checkoutType;
+
+    in >> chunk.startsPage >> chunk.hasCheckout >> checkoutType
+       >> chunk.hasTitle;
+    if (!in or in.get() != '\n')
+      return false;
+    chunk.checkoutType = static_cast<CheckoutType>(checkoutType);
+
+    if (!readField(in, chunk.opening) or
+        !readField(in, chunk.origin) or
+        !readField(in, chunk.checkoutName) or
+        !readField(in, chunk.content) or
+        !readField(in, chunk.title) or
+        !readField(in, chunk.include) or
+        !readList(in, chunk.repositories) or
+        !readList(in, chunk.paths) or
+        !readList(in, chunk.assets))
+      return false;
+
+    chunks.push_back(std::move(chunk));
+  }
+
+  return tag == "end" and in.get() == '\n' and readField(in, tail);
+}
+
+// Written atomically, two parts with the same content may be parsed at
+// once. A part that cannot be cached is parsed again next time.
+static void
+writeCache(const fs::path& cacheFile,
+           const std::vector<PartChunk>& chunks,
+           const std::string& tail) {
+  writeFileAtomically(cacheFile, [&](std::ostream& out) {
+    out << CACHE_VERSION << '\n';
+    for (const auto& chunk : chunks) {
+      out << "chunk "
+          << chunk.startsPage << ' '
+          << chunk.hasCheckout << ' '
+          << chunk.checkoutType << ' '
+          << chunk.hasTitle << '\n';
+      writeField(out, chunk.opening);
+      writeField(out, chunk.origin);
+      writeField(out, chunk.checkoutName);
+      writeField(out, chunk.content);
+      writeField(out, chunk.title);
+      writeField(out, chunk.include);
+      writeList(out, chunk.repositories);
+      writeList(out, chunk.paths);
+      writeList(out, chunk.assets);
+    }
+    out << "end\n";
+    writeField(out, tail);
+
+    return true;
+  });
+}
+
+static void
+parsePart(StoryPart& part, const fs::path& cacheDir) {
+  std::ifstream input(part.file, std::ios::binary);
+
+  if (!input) return;
+
+  std::string text { std::istreambuf_iterator<char>(input),
+                     std::istreambuf_iterator<char>() };
+  part.readable = true;
+  part.digest = contentDigest(text);
+
+  fs::path cacheFile { cacheDir / part.digest };
+  if (readCache(cacheFile, part.chunks, part.tail)) {
+    part.cached = true;
+    return;
+  }
+
+  part.chunks.clear();
+  std::istringstream lines { text };
+  part.chunks = parseChunks(lines, part.tail);
+  writeCache(cacheFile, part.chunks, part.tail);
+}
+
+bool
+StoryParts::load(const fs::path& storyFile, const fs::path& cacheDir) {
+  std::vector<std::pair<fs::path, fs::path>> pending;
+  bool loaded = true;
+
+  root = fs::weakly_canonical(storyFile);
+  pending.emplace_back(root, fs::path());
+
+  std::error_code error;
+  fs::create_directories(cacheDir, error);
+
+  while (!pending.empty()) {
+    std::vector<std::pair<StoryPart*, fs::path>> level;
+
+    for (const auto& file : pending) {
+      if (parts.count(file.first)) continue;
+
+      StoryPart& part = parts[file.first];
+      part.file = file.first;
+      order.push_back(file.first);
+      level.emplace_back(&part, file.second);
+    }
+
+    std::atomic<size_t> next { 0 };
+    std::vector<std::thread> workers;
+    size_t nWorkers = std::min<size_t>(level.size(),
+                                       std::thread::hardware_concurrency());
+    nWorkers = std::max<size_t>(nWorkers, 1);
+
+    for (size_t i = 0; i < nWorkers; i++)
+      workers.emplace_back([&]() {
+        for (size_t slot = next++; slot < level.size(); slot = next++)
+          parsePart(*level[slot].first, cacheDir);
+      });
+
+    for (auto& worker : workers)
+      worker.join();
+
+    pending.clear();
+
+    for (const auto& entry : level) {
+      const StoryPart& part = *entry.first;
+
+      if (!part.readable) {
+        LogLine error(LOG_ERROR, "Cannot open");
+        error.field("file", part.file);
+        if (!entry.second.empty())
+          error.field("included_from", entry.second);
+        loaded = false;
+        continue;
+      }
+
+      for (const auto& chunk : part.chunks)
+        if (!chunk.include.empty())
+          pending.emplace_back(includedFile(part.file, chunk.include),
+                               part.file);
+    }
+  }
+
+  if (!loaded)
+    return false;
+
+  std::vector<fs::path> chain;
+  if (hasCycle(root, chain)) {
+    std::string files;
+    for (const auto& file : chain)
+      files += (files.empty() ? "" : " -> ") + file.string();
+    LogLine(LOG_ERROR, "Include cycle").field("files", files);
+    return false;
+  }
+
+  // Only the parts of this story are kept, other files are left alone
+  std::set<std::string> digests;
+  for (const auto& part : parts)
+    digests.insert(part.second.digest);
+
+  for (const auto& entry : fs::directory_iterator(cacheDir, error)) {
+    std::string name { entry.path().filename().string() };
+    if (isPartFile(name) and !digests.count(name))
+      fs::remove(entry.path(), error);
+  }
+
+  return true;
+}
+
+bool
+StoryParts::hasCycle(const fs::path& file,
+                     std::vector<fs::path>& chain) const {
+  if (std::find(chain.begin(), chain.end(), file) != chain.end()) {
+    chain.push_back(file);
+    return true;
+  }
+
+  chain.push_back(file);
+
+  for (const auto& chunk : parts.at(file).chunks)
+    if (!chunk.include.empty() and
+        hasCycle(includedFile(file, chunk.include), chain))
+      return true;
+
+  chain.pop_back();
+  return false;
+}
+
+std::string
+StoryParts::digest() const {
+  std::string digests;
+
+  for (const auto& file : order)
+    digests += parts.at(file).digest;
+
+  return contentDigest(digests);
+}
+
+size_t
+StoryParts::cachedParts() const {
+  return std::count_if(parts.begin(), parts.end(),
+                       [](const std::pair<const fs::path, StoryPart>& part) {
+                         return part.second.cached;
+                       });
+}
+
+struct StoryParts::Builder {
+  StoryPage page;
+  std::ostringstream buffer;
+  std::string message;
+};
+
+// Returns false once the last page asked for with -n has been handed out
+bool
+StoryParts::append(const StoryPart& part,
+                   Builder& builder,
+                   BoundedQueue<StoryPage>& parsedPages,
+                   Options& options) const {
+  for (const auto& chunk : part.chunks) {
+    if (!chunk.include.empty()) {
+      if (!append(parts.at(includedFile(part.file, chunk.include)),
+                  builder,
+                  parsedPages,
+                  options))
+        return false;
+      continue;
+    }
+
+    if (chunk.startsPage and builder.buffer.tellp() > 0) {
+      int number = builder.page.number;
+      builder.page.content = builder.buffer.str();
+      builder.page.message = builder.message;
+      parsedPages.push(std::move(builder.page));
+
+      if (number == options.pagesProcessed)
+        return false;
+
+      builder.page = StoryPage();
+      builder.page.number = number + 1;
+      builder.buffer.str("");
+      builder.buffer << chunk.opening;
+    }
+
+    StoryPage& page = builder.page;
+    page.repositories.insert(page.repositories.end(),
+                             chunk.repositories.begin(),
+                             chunk.repositories.end());
+    page.paths.insert(page.paths.end(),
+                      chunk.paths.begin(),
+                      chunk.paths.end());
+    page.assets.insert(page.assets.end(),
+                       chunk.assets.begin(),
+                       chunk.assets.end());
+
+    if (chunk.hasCheckout) {
+      page.checkoutType = chunk.checkoutType;
+      page.checkoutName = chunk.checkoutName;
+    }
+
+    if (!chunk.origin.empty())
+      page.origin = chunk.origin;
+
+    builder.buffer << chunk.content;
+
+    if (chunk.hasTitle)
+      builder.message = chunk.title;
+  }
+
+  return true;
+}
+
+void
+StoryParts::pages(BoundedQueue<StoryPage>& parsedPages,
+                  Options& options) const {
+  Builder builder;
+  builder.page.number = 1;
+
+  const StoryPart& story = parts.at(root);
+
+  if (append(story, builder, parsedPages, options)) {
+    // As it always did, the last page ends with what getline left in its
+    // line: nothing, or the last line again when it has no newline
+    builder.buffer << story.tail << std::endl;
+
+    builder.page.content = builder.buffer.str();
+    builder.page.message = builder.message;
+    builder.page.isLast = true;
+    parsedPages.push(std::move(builder.page));
+  }
+
+  parsedPages.close();
+}
@@ -0,0 +1,104 @@
+#!/bin/sh
+# Builds a story whose nested asset directory sits under a directory the
+# source repository only has on some pages:
+#   assets.sh <md2cs>
+# docs/images is declared on the first page, while docs/ appears in the
+# source on the second page and is gone again on the third. Every commit
+# has to keep the assets, and only docs/guide.md may come and go.
+set -e
+
+md2cs=$1
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+export HOME="$work"
+export XDG_CONFIG_HOME="$work/.config"
+git config --global user.name "md2cs assets"
+git config --global user.email "assets@md2cs"
+git config --global init.defaultBranch main
+
+story="$work/story"
+source="$story/source"
+mkdir -p "$source/src" "$story/docs/images"
+echo "picture" > "$story/docs/images/pic.txt"
+git -C "$source" init -q
+
+echo "step 1" > "$source/src/main.txt"
+git -C "$source" add -A
+git -C "$source" commit -q -m "Step 1"
+git -C "$source" tag v1
+
+mkdir "$source/docs"
+echo "guide" > "$source/docs/guide.md"
+echo "step 2" > "$source/src/main.txt"
+git -C "$source" add -A
+git -C "$source" commit -q -m "Step 2"
+git -C "$source" tag v2
+
+git -C "$source" rm -q -r docs
+echo "step 3" > "$source/src/main.txt"
+git -C "$source" commit -q -m "Step 3"
+git -C "$source" tag v3
+
+cat > "$story/story.md" <<STORY
+---
+repository: ./source
+origin: ./origin.git
+---
+
+# Assets story
+
+---
+tag: v1
+assets: docs/images
+---
+
+### Page 1
+
+---
+tag: v2
+---
+
+### Page 2
+
+---
+tag: v3
+---
+
+### Page 3
+STORY
+
+(cd "$story" && "$md2cs" < /dev/null)
+
+repo="$story/target/repository"
+commits=$(git -C "$repo" rev-list --reverse HEAD)
+[ "$(echo "$commits" | wc -l)" -eq 3 ] || {
+  git -C "$repo" log --stat
+  echo "expected a commit for each of the three pages"
+  exit 1
+}
+
+page=0
+for commit in $commits; do
+  page=$((page + 1))
+  files=$(git -C "$repo" ls-tree -r --name-only "$commit")
+  echo "$files" | grep -qx "docs/images/pic.txt" || {
+    echo "$files"
+    echo "page $page lost docs/images/pic.txt"
+    exit 1
+  }
+  guide=0
+  echo "$files" | grep -qx "docs/guide.md" || guide=$?
+  if { [ $page -eq 2 ] && [ $guide -ne 0 ]; } ||
+     { [ $page -ne 2 ] && [ $guide -eq 0 ]; }; then
+    echo "$files"
+    echo "page $page has the wrong docs/guide.md"
+    exit 1
+  fi
+done
+
+[ -f "$repo/docs/images/pic.txt" ] && [ ! -e "$repo/docs/guide.md" ] || {
+  find "$repo/docs"
+  echo "the working tree does not match the last page"
+  exit 1
+}
@@ -0,0 +1,151 @@
+#!/bin/sh
+# Uploads a small story over ssh to a throwaway sshd and walks the
+# credential chain without a terminal:
+#   credentials.sh <md2cs>
+# Every step takes away the credential the previous one used: ssh-agent,
+# MD2CS_SSH_KEY with its passphrase, the unencrypted key in ~/.ssh, and at
+# last nothing, where md2cs has to give up instead of asking. One origin
+# URL has no user, so libgit2 asks for the user name before the key. Exits
+# with 77 (skipped) when sshd is not installed.
+set -e
+
+md2cs=$1
+sshd=$(command -v sshd || ls /usr/sbin/sshd 2>/dev/null || true)
+[ -n "$sshd" ] || { echo "sshd not found, skipping"; exit 77; }
+
+work=$(mktemp -d)
+agent=
+cleanup() {
+  [ ! -f "$work/sshd/pid" ] || kill "$(cat "$work/sshd/pid")" 2>/dev/null || :
+  [ -z "$agent" ] || kill "$agent" 2>/dev/null || :
+  rm -rf "$work"
+}
+trap cleanup EXIT
+
+export HOME="$work/home"
+export XDG_CONFIG_HOME="$HOME/.config"
+export GIT_TERMINAL_PROMPT=0
+unset SSH_AUTH_SOCK MD2CS_SSH_KEY MD2CS_SSH_PASSPHRASE MD2CS_TOKEN
+mkdir -p "$HOME/.ssh" "$work/sshd"
+chmod 700 "$HOME/.ssh"
+git config --global user.name "md2cs credentials"
+git config --global user.email "credentials@md2cs"
+git config --global init.defaultBranch main
+
+# PEM ECDSA keys are read by every libssh2 that md2cs builds with
+keygen() {
+  ssh-keygen -q -t ecdsa -m PEM -N "$2" -C "$(basename "$1")" -f "$1"
+  cat "$1.pub" >> "$work/sshd/authorized_keys"
+}
+ssh-keygen -q -t ecdsa -N "" -f "$work/sshd/host_key"
+keygen "$work/agent_key" ""
+keygen "$work/pass_key" "open sesame"
+keygen "$HOME/.ssh/id_ecdsa" ""
+
+port=${MD2CS_TEST_SSH_PORT:-$((20000 + $$ % 20000))}
+cat > "$work/sshd/sshd_config" <<CONFIG
+Port $port
+ListenAddress 127.0.0.1
+HostKey $work/sshd/host_key
+PidFile $work/sshd/pid
+AuthorizedKeysFile $work/sshd/authorized_keys
+StrictModes no
+UsePAM no
+PasswordAuthentication no
+KbdInteractiveAuthentication no
+PubkeyAuthentication yes
+CONFIG
+"$sshd" -D -e -f "$work/sshd/sshd_config" 2> "$work/sshd/log" &
+
+# The host key is trusted through known_hosts, as on a real server
+tries=0
+until ssh-keyscan -p "$port" -t ecdsa 127.0.0.1 \
+        > "$HOME/.ssh/known_hosts" 2>/dev/null &&
+      [ -s "$HOME/.ssh/known_hosts" ]; do
+  tries=$((tries + 1))
+  [ $tries -lt 50 ] || { cat "$work/sshd/log"; exit 1; }
+  sleep 0.2
+done
+
+source="$work/source"
+mkdir -p "$source/src"
+git -C "$source" init -q
+echo "step 1" > "$source/src/step1.txt"
+git -C "$source" add -A
+git -C "$source" commit -q -m "Step 1"
+git -C "$source" tag v1
+
+# upload <case> <expected exit status> [source of the last credential tried]
+# The origin URL has no user when $owner is set; the user is then taken
+# from the directory above the repository, as in host/owner/repo.git.
+user=$(id -un)
+owner=
+upload() {
+  login="$user@"
+  [ -z "$owner" ] || login=
+  bare="$work/${owner:+$owner/}$1.git"
+  git init -q --bare "$bare"
+  mkdir -p "$work/$1"
+  cat > "$work/$1/story.md" <<STORY
+---
+repository: $source
+origin: ssh://${login}127.0.0.1:$port$bare
+---
+
+# Credentials story
+
+---
+tag: v1
+---
+
+### Page 1
+STORY
+  status=0
+  (cd "$work/$1" && "$md2cs" -d -u < /dev/null) > "$work/$1.log" 2>&1 ||
+    status=$?
+  if { [ $2 -eq 0 ] && [ $status -ne 0 ]; } ||
+     { [ $2 -ne 0 ] && [ $status -eq 0 ]; }; then
+    cat "$work/$1.log" "$work/sshd/log"
+    echo "$1: md2cs exited with $status"
+    exit 1
+  fi
+  if [ $2 -eq 0 ] &&
+     ! git --git-dir="$bare" rev-parse -q --verify main >/dev/null; then
+    cat "$work/$1.log"
+    echo "$1: main was not pushed"
+    exit 1
+  fi
+  if [ -n "$3" ] &&
+     ! grep "Trying credential" "$work/$1.log" | tail -n 1 |
+       grep -q "source=$3"; then
+    cat "$work/$1.log"
+    echo "$1: $3 was not the credential used"
+    exit 1
+  fi
+}
+
+eval "$(ssh-agent -s)" > /dev/null
+agent=$SSH_AGENT_PID
+ssh-add -q "$work/agent_key" 2>/dev/null
+upload agent 0 ssh-agent
+
+# Asked for the user name first, the agent must still come next
+owner=$user
+upload username 0 ssh-agent
+owner=
+
+ssh-add -q -D 2>/dev/null
+export MD2CS_SSH_KEY="$work/pass_key"
+export MD2CS_SSH_PASSPHRASE="open sesame"
+upload passphrase 0 MD2CS_SSH_KEY
+
+export MD2CS_SSH_PASSPHRASE="wrong"
+upload home-key 0 "$HOME/.ssh/id_ecdsa"
+
+rm "$HOME/.ssh/id_ecdsa" "$HOME/.ssh/id_ecdsa.pub"
+upload none 1
+grep -q "No usable credential" "$work/none.log" || {
+  cat "$work/none.log"
+  echo "none: the missing credential was not reported"
+  exit 1
+}
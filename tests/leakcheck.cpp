@@ -0,0 +1,61 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include "helper.h"
+
+// Builds one story again and again in a single process and fails when
+// the resident set keeps growing once the first builds have warmed the
+// allocator and libgit2's caches.
+//
+//   leakcheck <story-dir> [builds]
+
+const static int WARMUP_BUILDS { 20 };
+const static long ALLOWED_GROWTH_KB { 1024 };
+
+static long
+residentKB() {
+  std::ifstream statm("/proc/self/statm");
+  long size = 0;
+  long resident = 0;
+
+  statm >> size >> resident;
+  return resident * (::sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int
+main(int argc, char* argv[]) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " <story-dir> [builds]"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  fs::path storyDir { fs::absolute(argv[1]) };
+  int builds = argc > 2 ? std::max(1, std::atoi(argv[2])) : 1000;
+  int warmup = std::min(WARMUP_BUILDS, builds);
+  long warm = 0;
+
+  Log::start(LOG_ERROR);
+
+  for (int build = 1; build <= builds; build++) {
+    Options options;
+    options.verbosity = LOG_ERROR;
+
+    if (processStoryFile(storyDir, options) != EXIT_SUCCESS) {
+      std::cerr << "Build " << build << " failed" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    if (build == warmup)
+      warm = residentKB();
+  }
+
+  long growth = residentKB() - warm;
+  std::cout << builds << " builds, the resident set grew " << growth
+            << " KiB after build " << warmup << std::endl;
+
+  return growth > ALLOWED_GROWTH_KB ? EXIT_FAILURE : EXIT_SUCCESS;
+}
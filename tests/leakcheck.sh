@@ -0,0 +1,62 @@
+#!/bin/sh
+# Builds a small offline story with the leakcheck harness:
+#   leakcheck.sh <leakcheck> <builds>
+# The story checks out three tags of a local source repository. Set
+# LEAKCHECK_WRAPPER to run the harness under a tool such as valgrind.
+set -e
+
+harness=$1
+builds=${2:-1000}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# Commits are signed with the global identity, kept away from the user's
+export HOME="$work"
+export XDG_CONFIG_HOME="$work/.config"
+git config --global user.name "md2cs leakcheck"
+git config --global user.email "leakcheck@md2cs"
+git config --global init.defaultBranch main
+
+story="$work/story"
+source="$story/source"
+mkdir -p "$source/src"
+git -C "$source" init -q
+
+for step in 1 2 3; do
+  echo "step $step" > "$source/src/step$step.txt"
+  echo "version $step" > "$source/src/version.txt"
+  [ $step -ne 3 ] || git -C "$source" rm -q src/step1.txt
+  git -C "$source" add -A
+  git -C "$source" commit -q -m "Step $step"
+  git -C "$source" tag "v$step"
+done
+
+cat > "$story/story.md" <<STORY
+---
+repository: ./source
+origin: ./origin.git
+---
+
+# Leak check story
+
+---
+tag: v1
+focus: src
+---
+
+### Page 1
+
+---
+tag: v2
+---
+
+### Page 2
+
+---
+tag: v3
+---
+
+### Page 3
+STORY
+
+$LEAKCHECK_WRAPPER "$harness" "$story" "$builds"